@@ -0,0 +1,239 @@
+// BGZF output. Data is copied into a ring of 64KB blocks; worker threads
+// take full blocks in order and compress them independently, and a writer
+// thread writes the compressed blocks out in the order they were filled.
+// The ring gives a bit of slack on both sides so that neither the caller
+// nor the disk waits on compression unless compression is simply too slow.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "bgzf.h"
+
+#define BGZF_BLOCK 0xff00  // Uncompressed bytes per block (as htslib)
+#define BGZF_MAX 0x10000   // Largest block allowed by the format
+#define BGZF_HDR 18
+#define BGZF_FTR 8
+
+// Blocks per compression thread
+#define SLOTS_PER_THREAD 4
+
+enum { SLOT_EMPTY, SLOT_FULL, SLOT_BUSY, SLOT_DONE };
+
+struct slot {
+  int state;
+  size_t inlen;
+  size_t outlen;
+  unsigned char in[BGZF_BLOCK];
+  unsigned char out[BGZF_MAX];
+};
+
+struct _bgzf_writer {
+  int fd;
+  int level;
+  int nthreads;
+  int nslots;
+  struct slot *slots;
+  // Running counts of blocks filled, taken for compression and written;
+  // block k lives in slots[k % nslots]
+  unsigned long long fill, comp, out;
+  int have_slot;   // Whether slots[fill % nslots] is being filled
+  int done;
+  pthread_mutex_t lock;
+  pthread_cond_t full;
+  pthread_cond_t compressed;
+  pthread_cond_t empty;
+  pthread_t *workers;
+  pthread_t writer;
+};
+
+// An empty block, which marks the end of the file
+static const unsigned char bgzf_eof[28] = {
+  31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0,
+  27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static void write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      perror("Error writing output");
+      return;
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+static inline void put16(unsigned char *p, unsigned int x) {
+  p[0] = x & 0xff;
+  p[1] = (x >> 8) & 0xff;
+}
+
+static inline void put32(unsigned char *p, unsigned long x) {
+  put16(p, x & 0xffff);
+  put16(p + 2, (x >> 16) & 0xffff);
+}
+
+// Compresses one block into a complete gzip member with the BGZF header
+static void compress_slot(z_stream *zs, struct slot *s) {
+  static const unsigned char hdr[BGZF_HDR - 2] = {
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0
+  };
+  size_t clen;
+  deflateReset(zs);
+  zs->next_in = s->in;
+  zs->avail_in = s->inlen;
+  zs->next_out = s->out + BGZF_HDR;
+  zs->avail_out = BGZF_MAX - BGZF_HDR - BGZF_FTR;
+  if (deflate(zs, Z_FINISH) == Z_STREAM_END) {
+    clen = zs->total_out;
+  }
+  else {
+    // Incompressible; fall back to a single stored deflate block
+    unsigned char *p = s->out + BGZF_HDR;
+    p[0] = 1;
+    put16(p + 1, s->inlen);
+    put16(p + 3, ~s->inlen);
+    memcpy(p + 5, s->in, s->inlen);
+    clen = s->inlen + 5;
+  }
+  s->outlen = BGZF_HDR + clen + BGZF_FTR;
+  memcpy(s->out, hdr, sizeof(hdr));
+  put16(s->out + 16, s->outlen - 1);
+  put32(s->out + BGZF_HDR + clen, crc32(crc32(0, 0, 0), s->in, s->inlen));
+  put32(s->out + BGZF_HDR + clen + 4, s->inlen);
+}
+
+static void *compress_worker(void *arg) {
+  bgzf_writer *w = arg;
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  deflateInit2(&zs, w->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (w->comp == w->fill && !w->done)
+      pthread_cond_wait(&w->full, &w->lock);
+    if (w->comp == w->fill)
+      break;
+    struct slot *s = &w->slots[w->comp++ % w->nslots];
+    s->state = SLOT_BUSY;
+    pthread_mutex_unlock(&w->lock);
+    compress_slot(&zs, s);
+    pthread_mutex_lock(&w->lock);
+    s->state = SLOT_DONE;
+    pthread_cond_broadcast(&w->compressed);
+  }
+  pthread_mutex_unlock(&w->lock);
+  deflateEnd(&zs);
+  return NULL;
+}
+
+static void *write_worker(void *arg) {
+  bgzf_writer *w = arg;
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    struct slot *s = &w->slots[w->out % w->nslots];
+    while ((w->out == w->fill) ? !w->done : (s->state != SLOT_DONE))
+      pthread_cond_wait(&w->compressed, &w->lock);
+    if (w->out == w->fill)
+      break;
+    pthread_mutex_unlock(&w->lock);
+    write_all(w->fd, s->out, s->outlen);
+    pthread_mutex_lock(&w->lock);
+    s->state = SLOT_EMPTY;
+    w->out++;
+    pthread_cond_signal(&w->empty);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+bgzf_writer *bgzf_open(int fd, int level, int nthreads) {
+  bgzf_writer *w = calloc(1, sizeof(bgzf_writer));
+  if (!w)
+    return 0;
+  if (nthreads < 1)
+    nthreads = 1;
+  w->fd = fd;
+  w->level = level;
+  w->nthreads = nthreads;
+  w->nslots = SLOTS_PER_THREAD * nthreads;
+  w->slots = calloc(w->nslots, sizeof(struct slot));
+  w->workers = malloc(nthreads * sizeof(pthread_t));
+  if (!w->slots || !w->workers) {
+    free(w->slots);
+    free(w->workers);
+    free(w);
+    return 0;
+  }
+  pthread_mutex_init(&w->lock, 0);
+  pthread_cond_init(&w->full, 0);
+  pthread_cond_init(&w->compressed, 0);
+  pthread_cond_init(&w->empty, 0);
+  for (int i = 0; i < nthreads; ++i)
+    pthread_create(&w->workers[i], NULL, compress_worker, w);
+  pthread_create(&w->writer, NULL, write_worker, w);
+  return w;
+}
+
+// Hands the block being filled over to the compression threads
+static void submit(bgzf_writer *w) {
+  pthread_mutex_lock(&w->lock);
+  w->slots[w->fill % w->nslots].state = SLOT_FULL;
+  w->fill++;
+  pthread_cond_signal(&w->full);
+  pthread_mutex_unlock(&w->lock);
+  w->have_slot = 0;
+}
+
+void bgzf_write(bgzf_writer *w, const char *data, size_t len) {
+  while (len) {
+    struct slot *s = &w->slots[w->fill % w->nslots];
+    if (!w->have_slot) {
+      // Wait for the writer to finish with the next block
+      pthread_mutex_lock(&w->lock);
+      while (s->state != SLOT_EMPTY)
+	pthread_cond_wait(&w->empty, &w->lock);
+      pthread_mutex_unlock(&w->lock);
+      s->inlen = 0;
+      w->have_slot = 1;
+    }
+    size_t n = BGZF_BLOCK - s->inlen;
+    if (n > len)
+      n = len;
+    memcpy(s->in + s->inlen, data, n);
+    s->inlen += n;
+    data += n;
+    len -= n;
+    if (s->inlen == BGZF_BLOCK)
+      submit(w);
+  }
+}
+
+void bgzf_close(bgzf_writer *w) {
+  if (w->have_slot && w->slots[w->fill % w->nslots].inlen)
+    submit(w);
+  pthread_mutex_lock(&w->lock);
+  w->done = 1;
+  pthread_cond_broadcast(&w->full);
+  pthread_cond_broadcast(&w->compressed);
+  pthread_mutex_unlock(&w->lock);
+  for (int i = 0; i < w->nthreads; ++i)
+    pthread_join(w->workers[i], NULL);
+  pthread_join(w->writer, NULL);
+  write_all(w->fd, bgzf_eof, sizeof(bgzf_eof));
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->full);
+  pthread_cond_destroy(&w->compressed);
+  pthread_cond_destroy(&w->empty);
+  free(w->slots);
+  free(w->workers);
+  free(w);
+}
@@ -0,0 +1,25 @@
+#ifndef _BGZF_H
+#define _BGZF_H
+
+#include <stddef.h>
+
+// Block-compressed output in the BGZF container format (a series of
+// independent gzip members of at most 64KB each, readable by gzip and by
+// anything that understands BGZF). Blocks are compressed by a pool of
+// worker threads and written out in order by a separate writer thread, so
+// the caller only ever copies data into a block.
+
+typedef struct _bgzf_writer bgzf_writer;
+
+// Starts nthreads compression threads writing to fd at the given zlib
+// compression level (-1 for zlib's default)
+bgzf_writer *bgzf_open(int fd, int level, int nthreads);
+
+// Queues data for output; blocks only if every block is still waiting to
+// be compressed or written. Not to be called from several threads at once.
+void bgzf_write(bgzf_writer *w, const char *data, size_t len);
+
+// Flushes everything, writes the end-of-file marker and frees the writer
+void bgzf_close(bgzf_writer *w);
+
+#endif /* _BGZF_H */
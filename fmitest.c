@@ -89,6 +89,98 @@ void startWorkers(fm_index *fmi, long long num, unsigned char *pats) {
   return;
 }
 
+// Compares loc_search_k against the old heuristic (mms, then mms_mismatch
+// at the first base that doesn't match) on patterns taken from str with
+// one or two random differences, for how many of them each finds where
+// they came from (to within a few bases) and how long it takes
+#define APPROX_N 20000
+#define APPROX_LEN 32
+#define APPROX_K 2
+
+static int near(const fm_index *fmi, long long sp, long long ep, long long pos) {
+  long long locs[16];
+  long long n = locate_range(fmi, sp, ep, 16, locs);
+  for (long long i = 0; i < n; ++i)
+    if (llabs(locs[i] - pos) <= APPROX_K)
+      return 1;
+  return 0;
+}
+
+void approx_bench(const fm_index *fmi, const unsigned char *str, long long len) {
+  unsigned char *pats = malloc(APPROX_N * (APPROX_LEN + APPROX_K));
+  long long *origin = malloc(APPROX_N * sizeof(long long));
+  int *plen = malloc(APPROX_N * sizeof(int)), *found = calloc(APPROX_N, sizeof(int));
+  kmatch out[256];
+  unsigned long long a, b;
+  long long i;
+  int j, nfound;
+  for (i = 0; i < APPROX_N; ++i) {
+    unsigned char *p = pats + i * (APPROX_LEN + APPROX_K);
+    int n, ndiffs = 1 + (i & 1);
+    origin[i] = rand() % (len - 2 * APPROX_LEN);
+    for (n = 0; n < APPROX_LEN; ++n)
+      p[n] = getbase(str, origin[i] + n);
+    while (ndiffs--) {
+      int at = 1 + rand() % (APPROX_LEN - 2);
+      switch (rand() % 3) {
+      case 0: // substitution
+	p[at] = (p[at] + 1 + rand() % 3) & 3;
+	break;
+      case 1: // insertion
+	memmove(p + at + 1, p + at, n - at);
+	p[at] = rand() & 3;
+	n++;
+	break;
+      default: // deletion
+	memmove(p + at, p + at + 1, n - at - 1);
+	n--;
+      }
+    }
+    plen[i] = n;
+  }
+
+  rdtscll(a);
+  for (i = 0; i < APPROX_N; ++i) {
+    const unsigned char *p = pats + i * (APPROX_LEN + APPROX_K);
+    long long sp, ep;
+    int skips, seglen = mms(fmi, p, plen[i], &sp, &ep);
+    if (seglen == plen[i])
+      found[i] = 1;
+    else if (mms_mismatch(fmi, str, p, plen[i] - seglen, &sp, &ep, 10, &skips) == plen[i] - seglen)
+      found[i] = 2;
+  }
+  rdtscll(b);
+  for (nfound = i = 0; i < APPROX_N; ++i) {
+    const unsigned char *p = pats + i * (APPROX_LEN + APPROX_K);
+    long long sp, ep;
+    int skips, seglen = mms(fmi, p, plen[i], &sp, &ep);
+    if (found[i] == 2)
+      mms_mismatch(fmi, str, p, plen[i] - seglen, &sp, &ep, 10, &skips);
+    nfound += found[i] && near(fmi, sp, ep, origin[i]);
+  }
+  printf("mms_mismatch: found %d of %d %dbp patterns with 1-2 differences in %f cycles each\n",
+	 nfound, APPROX_N, APPROX_LEN, ((double)(b-a)) / APPROX_N);
+
+  rdtscll(a);
+  for (i = 0; i < APPROX_N; ++i)
+    loc_search_k(fmi, pats + i * (APPROX_LEN + APPROX_K), plen[i], APPROX_K, out, 256);
+  rdtscll(b);
+  for (nfound = i = 0; i < APPROX_N; ++i) {
+    int n = loc_search_k(fmi, pats + i * (APPROX_LEN + APPROX_K), plen[i], APPROX_K, out, 256);
+    for (j = 0; j < n; ++j)
+      if (near(fmi, out[j].sp, out[j].ep, origin[i])) {
+	nfound++;
+	break;
+      }
+  }
+  printf("loc_search_k: found %d of %d %dbp patterns with 1-2 differences in %f cycles each\n",
+	 nfound, APPROX_N, APPROX_LEN, ((double)(b-a)) / APPROX_N);
+  free(pats);
+  free(origin);
+  free(plen);
+  free(found);
+}
+
 // Misfeature: Index construction is O(n log n) on average; this is fast enough
 // to dominate SACA-K below a billion base pairs or so, but uses too much
 // memory
@@ -163,6 +255,8 @@ int main(int argc, char **argv) {
   printf("(%f cycles per base pair (%e seconds))\n", ((double)(b-a))	\
 	 / 120000000., ((double)(b-a)) / 288000000000000000.);
   
+  approx_bench(fmi, str, len);
+
   destroy_fmi(fmi);
   // With current settings the FMI with 1000000 base pairs takes
   // 1.5 million bytes to store (50% auxiliary data)
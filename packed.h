@@ -0,0 +1,51 @@
+#ifndef _PACKED_H
+#define _PACKED_H
+
+#include <string.h>
+
+// Helpers for comparing reads against the packed sequence (2 bits a base,
+// first base in the high bits of each byte) a whole word at a time: both
+// sides are packed the same way into the top of a 64-bit word, so that
+// XORing them leaves a nonzero pair of bits wherever they differ.
+
+// The base at idx of the packed sequence
+static inline unsigned char ref_base(const unsigned char *seq, long long idx) {
+  return (seq[idx >> 2] >> (2 * (3 - (idx & 3)))) & 3;
+}
+
+// The n (at most 32) bases of the packed sequence from pos on. Only the
+// bytes those bases are in are read.
+static inline unsigned long long seq_word(const unsigned char *seq, long long pos, int n) {
+  const unsigned char *p = seq + (pos >> 2);
+  const int sh = 2 * (pos & 3), nb = (sh + 2 * n + 7) / 8;
+  unsigned long long w = 0;
+  if (nb >= 8) {
+    memcpy(&w, p, 8);
+    w = __builtin_bswap64(w) << sh;
+    if (nb > 8)
+      w |= p[8] >> (8 - sh);
+  }
+  else {
+    for (int i = 0; i < nb; ++i)
+      w |= (unsigned long long) p[i] << (56 - 8 * i);
+    w <<= sh;
+  }
+  return w;
+}
+
+// n (at most 32) bases of a read (0-3, or 5 for N); both bits of a base are
+// set in *care unless it is an N, which should match anything
+static inline unsigned long long read_word(const unsigned char *str, int n, unsigned long long *care) {
+  unsigned long long w = 0, c = 0;
+  for (int k = 0; k < n; ++k) {
+    const int sh = 62 - 2 * k;
+    if (str[k] <= 3) {
+      w |= (unsigned long long) str[k] << sh;
+      c |= 3ULL << sh;
+    }
+  }
+  *care = c;
+  return w;
+}
+
+#endif /* _PACKED_H */
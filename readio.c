@@ -0,0 +1,387 @@
+// Read input: memory maps regular files (or block-reads anything else, e.g.
+// a pipe on stdin) and splits the input into chunks of complete records
+// (lines for raw input, groups of four lines for FASTQ), which are then
+// handed out as views without copying.
+
+#define _GNU_SOURCE // memrchr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "readio.h"
+
+// Roughly how much input goes into one chunk
+#define CHUNK_SIZE (1 << 20)
+
+// Read codes, 16 characters to a row (so A, C, G and T are in the fifth and
+// sixth rows, and a, c, g and t in the seventh and eighth); anything that
+// isn't a base becomes 5 (which matches anything)
+static const unsigned char fwd_code[256] = {
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 0, 5, 1, 5, 5, 5, 2, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 3, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 0, 5, 1, 5, 5, 5, 2, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 3, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5
+};
+
+// Finds the first newline in [p, end), 16 bytes at a time
+static const char *find_newline(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; p + 16 <= end; p += 16) {
+    int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+    if (m)
+      return p + __builtin_ctz(m);
+  }
+#endif
+  return memchr(p, '\n', end - p);
+}
+
+// Counts the newlines in [p, end), 16 bytes at a time
+static size_t count_newlines(const char *p, const char *end) {
+  size_t n = 0;
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; p + 16 <= end; p += 16)
+    n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl)));
+#endif
+  for (; p < end; ++p)
+    n += (*p == '\n');
+  return n;
+}
+
+// Whether [p, end) is an empty line (allowing for DOS line endings)
+static inline int blank(const char *p, const char *end) {
+  return (end == p) || (end == p + 1 && *p == '\r');
+}
+
+// Steps over the line [p, end) of FASTQ, the way chunk_next reads it: blank
+// lines are skipped between records, but the four lines of a record are
+// taken as they come, blank or not. *left is how many lines the current
+// record still has (0 between records). Returns whether the line ended one.
+static inline int fastq_line(const char *p, const char *end, int *left) {
+  if (!*left) {
+    if (blank(p, end))
+      return 0;
+    *left = 4;
+  }
+  return !--*left;
+}
+
+// Whether the line [p, end) ends a record (see fastq_line); in raw input,
+// any line that isn't blank is one
+static inline int record_line(const char *p, const char *end, int fastq, int *left) {
+  return fastq ? fastq_line(p, end, left) : !blank(p, end);
+}
+
+// Sets the input format from the first non-blank character of the input
+static void detect_format(read_input *ri, const char *p, size_t len) {
+  for (size_t i = 0; i < len; ++i)
+    if (p[i] != '\n' && p[i] != '\r') {
+      ri->fastq = (p[i] == '@');
+      return;
+    }
+}
+
+// Returns the offset just past the last complete record in p[0, len) which
+// ends within the first limit bytes (or, if there is no such record, just
+// past the first complete record), or 0 if there are no complete records
+static size_t cut_records(const char *p, size_t len, size_t limit, int fastq) {
+  if (!fastq) {
+    const char *nl = memrchr(p, '\n', limit < len ? limit : len);
+    if (!nl && limit < len)
+      nl = find_newline(p + limit, p + len);
+    return nl ? nl - p + 1 : 0;
+  }
+  // FASTQ records have to be counted out four lines at a time
+  size_t cut = 0, off = 0;
+  int left = 0;
+  while (off < len) {
+    const char *nl = find_newline(p + off, p + len);
+    if (!nl)
+      break;
+    size_t next = nl - p + 1;
+    if (fastq_line(p + off, nl, &left)) {
+      if (next > limit && cut)
+	break;
+      cut = next;
+      if (next >= limit)
+	break;
+    }
+    off = next;
+  }
+  return cut;
+}
+
+// Returns the offset just past the first n records in p[0, len), or 0 if
+// there aren't that many complete ones; if p[0, len) is all that's left of
+// the input, the last line may be missing its newline
+static size_t cut_n_records(const char *p, size_t len, long long n, int fastq, int last) {
+  long long seen = 0;
+  size_t off = 0;
+  int left = 0;
+  while (off < len) {
+    const char *nl = find_newline(p + off, p + len);
+    if (!nl)
+      return (last && record_line(p + off, p + len, fastq, &left) && ++seen == n) ? len : 0;
+    size_t next = nl - p + 1;
+    if (record_line(p + off, nl, fastq, &left) && ++seen == n)
+      return next;
+    off = next;
+  }
+  // Or its last line may be an empty quality line
+  return (last && left == 1 && ++seen == n) ? len : 0;
+}
+
+read_input *ri_open(const char *path) {
+  struct stat st;
+  read_input *ri = calloc(1, sizeof(read_input));
+  if (!ri)
+    return 0;
+  ri->fastq = -1;
+  if (strcmp(path, "-") == 0)
+    ri->fd = 0;
+  else
+    ri->fd = open(path, O_RDONLY);
+  if (ri->fd < 0) {
+    free(ri);
+    return 0;
+  }
+  if (fstat(ri->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (st.st_size == 0) {
+      ri->eof = 1;
+      return ri;
+    }
+    void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, ri->fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      ri->map = map;
+      ri->maplen = st.st_size;
+      detect_format(ri, ri->map, ri->maplen);
+    }
+  }
+  // Otherwise we fall back to reading blocks
+  return ri;
+}
+
+// These take n records if n is nonzero (or everything that's left, if
+// there aren't that many), and about CHUNK_SIZE bytes of them otherwise
+static int chunk_from_map(read_input *ri, read_chunk *c, long long n) {
+  const char *start = ri->map + ri->pos, *end = ri->map + ri->maplen;
+  const char *cut = end;
+  if (ri->pos >= ri->maplen)
+    return 0;
+  if (n) {
+    size_t len = cut_n_records(start, end - start, n, ri->fastq > 0, 1);
+    if (len)
+      cut = start + len;
+  }
+  else if (end - start > CHUNK_SIZE) {
+    // Cut after the last complete record; if a single record is longer than
+    // the chunk size, just extend the chunk to the end of it
+    size_t n = cut_records(start, end - start, CHUNK_SIZE, ri->fastq > 0);
+    if (n)
+      cut = start + n;
+  }
+  c->data = start;
+  c->len = cut - start;
+  c->pos = 0;
+  c->owned = 0;
+  c->fastq = ri->fastq > 0;
+  ri->pos += c->len;
+  return 1;
+}
+
+static int chunk_from_fd(read_input *ri, read_chunk *c, long long n) {
+  size_t cap = ri->carrylen + CHUNK_SIZE, filled = ri->carrylen, cut;
+  char *buf;
+  if (ri->eof && !ri->carrylen)
+    return 0;
+  buf = malloc(cap);
+  if (!buf)
+    return 0;
+  if (ri->carry)
+    memcpy(buf, ri->carry, ri->carrylen);
+  free(ri->carry);
+  ri->carry = 0;
+  ri->carrylen = 0;
+  for (;;) {
+    while (!ri->eof && filled < cap) {
+      ssize_t n = read(ri->fd, buf + filled, cap - filled);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n < 0)
+	perror("Error reading reads");
+      if (n <= 0)
+	ri->eof = 1;
+      else
+	filled += n;
+    }
+    if (ri->fastq < 0)
+      detect_format(ri, buf, filled);
+    if (ri->eof)
+      break;
+    if (n)
+      cut = cut_n_records(buf, filled, n, ri->fastq > 0, 0);
+    else
+      cut = cut_records(buf, filled, filled, ri->fastq > 0);
+    if (cut)
+      break;
+    // A single record (or the n of them) doesn't fit into the buffer; make
+    // it bigger
+    cap *= 2;
+    char *newbuf = realloc(buf, cap);
+    if (!newbuf) {
+      free(buf);
+      return 0;
+    }
+    buf = newbuf;
+  }
+  if (!filled) {
+    free(buf);
+    return 0;
+  }
+  if (ri->eof && !(n && (cut = cut_n_records(buf, filled, n, ri->fastq > 0, 1))))
+    cut = filled;
+  if (cut < filled) {
+    ri->carrylen = filled - cut;
+    ri->carry = malloc(ri->carrylen);
+    if (!ri->carry) {
+      // The input can't be picked up again partway through a record, so
+      // this is where it ends
+      ri->carrylen = 0;
+      ri->eof = 1;
+      free(buf);
+      return 0;
+    }
+    memcpy(ri->carry, buf + cut, ri->carrylen);
+  }
+  c->data = buf;
+  c->len = cut;
+  c->pos = 0;
+  c->owned = buf;
+  c->fastq = ri->fastq > 0;
+  return 1;
+}
+
+int ri_chunk(read_input *ri, read_chunk *c) {
+  return ri_chunk_records(ri, c, 0);
+}
+
+int ri_chunk_records(read_input *ri, read_chunk *c, long long n) {
+  if (!(ri->map ? chunk_from_map(ri, c, n) : chunk_from_fd(ri, c, n)))
+    return 0;
+  // Raw reads are numbered by line, so we need to know where we are
+  c->line = ri->lines + 1;
+  if (!c->fastq)
+    ri->lines += count_newlines(c->data, c->data + c->len);
+  return 1;
+}
+
+// Fetches the next line of a chunk (without the line ending)
+static int next_line(read_chunk *c, const char **line, int *len) {
+  if (c->pos >= c->len)
+    return 0;
+  const char *p = c->data + c->pos, *end = c->data + c->len;
+  const char *nl = find_newline(p, end);
+  const char *e = nl ? nl : end;
+  c->pos = e - c->data + 1;
+  c->line++;
+  if (e > p && e[-1] == '\r')
+    e--;
+  *line = p;
+  *len = e - p;
+  return 1;
+}
+
+int chunk_next(read_chunk *c, read_rec *r) {
+  const char *line;
+  int len;
+  do {
+    if (!next_line(c, &line, &len))
+      return 0;
+  } while (!len);
+  if (!c->fastq) {
+    r->id = c->line - 1;
+    r->name = 0;
+    r->namelen = 0;
+    r->seq = line;
+    r->qual = 0;
+    r->len = len;
+    return 1;
+  }
+  // Header: the name runs up to the first whitespace
+  r->id = 0;
+  r->name = line + 1;
+  for (r->namelen = 0; r->namelen < len - 1; ++r->namelen)
+    if (r->name[r->namelen] == ' ' || r->name[r->namelen] == '\t')
+      break;
+  if (!next_line(c, &r->seq, &r->len))
+    return 0;
+  if (!next_line(c, &line, &len) || !next_line(c, &r->qual, &len))
+    len = -1;
+  if (len != r->len) {
+    fprintf(stderr, "Truncated FASTQ record %.*s\n", r->namelen, r->name);
+    r->qual = 0;
+  }
+  return 1;
+}
+
+long long chunk_records(const read_chunk *c) {
+  read_chunk t = *c;
+  read_rec r;
+  long long n = 0;
+  while (chunk_next(&t, &r))
+    n++;
+  return n;
+}
+
+void chunk_release(read_chunk *c) {
+  free(c->owned);
+  c->owned = 0;
+}
+
+void ri_close(read_input *ri) {
+  if (!ri)
+    return;
+  if (ri->map)
+    munmap((void *)ri->map, ri->maplen);
+  if (ri->fd > 0)
+    close(ri->fd);
+  free(ri->carry);
+  free(ri);
+}
+
+void encode_read(const read_rec *r, unsigned char *fwd, unsigned char *rev, int minqual) {
+  const unsigned char *s = (const unsigned char *)r->seq;
+  int len = r->len;
+  for (int i = 0; i < len; ++i)
+    fwd[i] = fwd_code[s[i]];
+  if (minqual && r->qual) {
+    // Low quality bases are no better than an N
+    for (int i = 0; i < len; ++i)
+      if (r->qual[i] - 33 < minqual)
+	fwd[i] = 5;
+  }
+  if (rev)
+    for (int i = 0; i < len; ++i)
+      rev[len-i-1] = (fwd[i] == 5) ? 5 : 3 - fwd[i];
+}
@@ -0,0 +1,77 @@
+#ifndef _READIO_H
+#define _READIO_H
+
+#include <stddef.h>
+
+// Streaming input of reads, either one raw sequence per line or FASTQ
+// (detected from a leading '@'; records must have single-line sequence and
+// quality strings, as every current sequencer emits). Regular files are
+// memory-mapped; anything else (stdin, pipes) is read in large blocks.
+// Reads are handed out as views into the mapped file or the block buffer,
+// so they are never copied and there is no limit on their length.
+
+typedef struct _read_input {
+  int fd;
+  const char *map;     // Whole file if it could be mapped, 0 otherwise
+  size_t maplen;
+  size_t pos;          // Offset of the next unread byte of map
+  char *carry;         // Incomplete record left over from the last block
+  size_t carrylen;
+  int eof;
+  int fastq;           // -1 until the format has been seen
+  long long lines;     // Lines handed out so far (raw input only)
+} read_input;
+
+// A block of complete records. Chunks are independent of each other and of
+// the read_input they came from (other than the mapping, which lives until
+// ri_close), so they can be handed to different threads.
+typedef struct _read_chunk {
+  const char *data;
+  size_t len;
+  size_t pos;
+  char *owned;         // Buffer to free when the chunk is released, if any
+  int fastq;
+  long long line;      // Line number of the next line (raw input only)
+} read_chunk;
+
+// A single read; none of the strings are NUL-terminated. For raw input
+// name and qual are 0, and the read is identified by its line number.
+typedef struct _read_rec {
+  long long id;
+  const char *name;
+  int namelen;
+  const char *seq;
+  const char *qual;
+  int len;
+} read_rec;
+
+// Opens a read file; "-" means stdin. Returns 0 on failure.
+read_input *ri_open(const char *path);
+
+// Fetches the next chunk of records; returns 0 once the input is exhausted
+int ri_chunk(read_input *ri, read_chunk *c);
+
+// The same, but the chunk is of the next n records (or all that are left,
+// if there are fewer); for reading the second file of a pair in step with
+// the first
+int ri_chunk_records(read_input *ri, read_chunk *c, long long n);
+
+// How many records there are in the rest of a chunk
+long long chunk_records(const read_chunk *c);
+
+// Fetches the next record of a chunk; returns 0 at the end of the chunk.
+// Empty lines are skipped.
+int chunk_next(read_chunk *c, read_rec *r);
+
+void chunk_release(read_chunk *c);
+
+void ri_close(read_input *ri);
+
+// Converts a read into 0-3 form (anything other than ACGT becomes 5, which
+// the aligner treats as matching anything), writing the reverse complement
+// into rev if it is not null. Both buffers need r->len bytes.
+// If minqual is nonzero, bases with a (phred+33) quality below it are
+// also turned into 5.
+void encode_read(const read_rec *r, unsigned char *fwd, unsigned char *rev, int minqual);
+
+#endif /* _READIO_H */
@@ -0,0 +1,324 @@
+// Buffered SAM output. Each thread formats records into its own buffer;
+// the only shared state is the file descriptor, which is locked for the
+// duration of one (large) write. For sorted output the buffers go to the
+// sorter instead, which has its own lock.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "samout.h"
+
+// Buffers are flushed once they have this much in them
+#define SAM_FLUSH (1 << 20)
+
+// Complements, 16 characters to a row as for readio.c's read codes;
+// anything that isn't a base becomes N
+static const char comp[256] = {
+  'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'T', 'N', 'G', 'N', 'N', 'N', 'C', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'A', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 't', 'N', 'g', 'N', 'N', 'N', 'c', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'a', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+  'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N'
+};
+
+static void write_all(int fd, const char *p, size_t len) {
+  while (len) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      perror("Error writing output");
+      return;
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+// A record can't be left half written, so there is no carrying on
+// without the memory for it
+static void out_of_memory(void) {
+  fprintf(stderr, "Out of memory formatting output\n");
+  exit(-1);
+}
+
+// Makes sure there is space for n more bytes
+static inline void reserve(sam_buf *b, size_t n) {
+  if (b->len + n > b->cap) {
+    while (b->len + n > b->cap)
+      b->cap *= 2;
+    b->buf = realloc(b->buf, b->cap);
+    if (!b->buf)
+      out_of_memory();
+  }
+}
+
+static inline void put_char(sam_buf *b, char c) {
+  b->buf[b->len++] = c;
+}
+
+static inline void put_str(sam_buf *b, const char *s, size_t n) {
+  memcpy(b->buf + b->len, s, n);
+  b->len += n;
+}
+
+#define put_lit(b, s) put_str(b, s, sizeof(s) - 1)
+
+// Formats a non-negative integer (no sprintf)
+static inline void put_uint(sam_buf *b, unsigned long long x) {
+  char tmp[20];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + x % 10;
+    x /= 10;
+  } while (x);
+  while (n)
+    b->buf[b->len++] = tmp[--n];
+}
+
+sam_writer *sam_open(int fd, const char *rname) {
+  sam_writer *w = malloc(sizeof(sam_writer));
+  if (!w)
+    return 0;
+  w->fd = fd;
+  w->bgzf = 0;
+  w->sort = 0;
+  w->rname = rname;
+  pthread_mutex_init(&w->lock, 0);
+  return w;
+}
+
+sam_writer *sam_open_bgzf(int fd, const char *rname, int level, int nthreads) {
+  sam_writer *w = sam_open(fd, rname);
+  if (!w)
+    return 0;
+  w->bgzf = bgzf_open(fd, level, nthreads);
+  if (!w->bgzf) {
+    sam_close(w);
+    return 0;
+  }
+  return w;
+}
+
+// Writes straight to the output
+static void output(void *arg, const char *p, size_t len) {
+  sam_writer *w = arg;
+  pthread_mutex_lock(&w->lock);
+  if (w->bgzf)
+    bgzf_write(w->bgzf, p, len);
+  else
+    write_all(w->fd, p, len);
+  pthread_mutex_unlock(&w->lock);
+}
+
+void sam_sort(sam_writer *w, size_t membytes, const char *tmpdir) {
+  w->sort = sorter_make(membytes, tmpdir);
+}
+
+void sam_header(sam_writer *w, long long rlen, int argc, char **argv) {
+  sam_buf *b = sam_buf_make(w);
+  size_t n = strlen(w->rname);
+  reserve(b, 128 + n);
+  if (w->sort)
+    put_lit(b, "@HD\tVN:1.6\tSO:coordinate\n@SQ\tSN:");
+  else
+    put_lit(b, "@HD\tVN:1.6\tSO:unsorted\n@SQ\tSN:");
+  put_str(b, w->rname, n);
+  put_lit(b, "\tLN:");
+  put_uint(b, rlen);
+  put_lit(b, "\n@PG\tID:single_align\tPN:single_align\tCL:");
+  for (int i = 0; i < argc; ++i) {
+    n = strlen(argv[i]);
+    reserve(b, n + 2);
+    if (i)
+      put_char(b, ' ');
+    put_str(b, argv[i], n);
+  }
+  reserve(b, 1);
+  put_char(b, '\n');
+  // The header mustn't be sorted
+  output(w, b->buf, b->len);
+  b->len = 0;
+  sam_buf_destroy(b);
+}
+
+void sam_close(sam_writer *w) {
+  if (w->sort)
+    sorter_finish(w->sort, output, w);
+  if (w->bgzf)
+    bgzf_close(w->bgzf);
+  pthread_mutex_destroy(&w->lock);
+  free(w);
+}
+
+sam_buf *sam_buf_make(sam_writer *w) {
+  sam_buf *b = malloc(sizeof(sam_buf));
+  if (!b)
+    return 0;
+  b->w = w;
+  b->len = 0;
+  b->cap = 2 * SAM_FLUSH;
+  b->buf = malloc(b->cap);
+  if (!b->buf) {
+    free(b);
+    return 0;
+  }
+  b->nents = 0;
+  b->entcap = 0;
+  b->ents = 0;
+  return b;
+}
+
+void sam_flush(sam_buf *b) {
+  if (!b->len)
+    return;
+  if (b->w->sort)
+    sorter_add(b->w->sort, b->buf, b->ents, b->nents);
+  else
+    output(b->w, b->buf, b->len);
+  b->len = 0;
+  b->nents = 0;
+}
+
+void sam_buf_destroy(sam_buf *b) {
+  sam_flush(b);
+  free(b->buf);
+  free(b->ents);
+  free(b);
+}
+
+// Everything for a record up to where its mate is, which is left for the
+// caller to put in. An unmapped read is put at pos if that isn't negative.
+static void record_start(sam_buf *b, const read_rec *r, int namelen, int flag, long long pos,
+			 int mapq, const stack *cigar) {
+  int i;
+  if (b->w->sort) {
+    // There is only the one reference, so the key is just the position
+    // written (which an unmapped read placed with its mate has too);
+    // unmapped reads with nowhere to go go at the end
+    if (b->nents == b->entcap) {
+      b->entcap = b->entcap ? 2 * b->entcap : 1024;
+      b->ents = realloc(b->ents, b->entcap * sizeof(sort_ent));
+      if (!b->ents)
+	out_of_memory();
+    }
+    b->ents[b->nents].key = ((flag & SAM_UNMAPPED) && pos < 0) ? ~0ULL : (unsigned long long)pos;
+    b->ents[b->nents].off = b->len;
+  }
+  // Name, flag, rname, pos, mapq: at most 20 digits for each number
+  reserve(b, r->namelen + strlen(b->w->rname) + 80);
+  if (r->name)
+    put_str(b, r->name, namelen);
+  else
+    put_uint(b, r->id);
+  put_char(b, '\t');
+  put_uint(b, flag);
+  put_char(b, '\t');
+  if ((flag & SAM_UNMAPPED) && pos < 0) {
+    put_lit(b, "*\t0\t0\t*");
+  }
+  else if (flag & SAM_UNMAPPED) {
+    put_str(b, b->w->rname, strlen(b->w->rname));
+    put_char(b, '\t');
+    put_uint(b, pos + 1);
+    put_lit(b, "\t0\t*");
+  }
+  else {
+    put_str(b, b->w->rname, strlen(b->w->rname));
+    put_char(b, '\t');
+    put_uint(b, pos + 1);
+    put_char(b, '\t');
+    put_uint(b, mapq);
+    put_char(b, '\t');
+    // The CIGAR is on the stack back to front
+    reserve(b, 21 * cigar->size + 1);
+    for (i = cigar->size - 1; i >= 0; --i) {
+      put_uint(b, cigar->counts[i]);
+      put_char(b, cigar->chars[i]);
+    }
+    if (!cigar->size)
+      put_char(b, '*');
+  }
+}
+
+// And everything after it
+static void record_end(sam_buf *b, const read_rec *r, int flag) {
+  int i, rev = flag & SAM_REVERSE;
+  reserve(b, 2 * r->len + 3);
+  put_char(b, '\t');
+  if (rev)
+    for (i = r->len - 1; i >= 0; --i)
+      put_char(b, comp[(unsigned char)r->seq[i]]);
+  else
+    put_str(b, r->seq, r->len);
+  put_char(b, '\t');
+  if (!r->qual)
+    put_char(b, '*');
+  else if (rev)
+    for (i = r->len - 1; i >= 0; --i)
+      put_char(b, r->qual[i]);
+  else
+    put_str(b, r->qual, r->len);
+  put_char(b, '\n');
+  if (b->w->sort) {
+    b->ents[b->nents].len = b->len - b->ents[b->nents].off;
+    b->nents++;
+  }
+  if (b->len >= SAM_FLUSH)
+    sam_flush(b);
+}
+
+void sam_record(sam_buf *b, const read_rec *r, int flag, long long pos,
+		int mapq, const stack *cigar) {
+  record_start(b, r, r->namelen, flag, (flag & SAM_UNMAPPED) ? -1 : pos, mapq, cigar);
+  // rnext, pnext and tlen are meaningless for single reads
+  reserve(b, 16);
+  put_lit(b, "\t*\t0\t0");
+  record_end(b, r, flag);
+}
+
+void sam_pair_record(sam_buf *b, const read_rec *r, int flag, long long pos,
+		     int mapq, const stack *cigar, long long mpos, long long tlen) {
+  // Mates are usually named with a /1 and /2 on the end, which don't
+  // belong in the name
+  int namelen = r->namelen;
+  if (namelen > 2 && r->name[namelen-2] == '/' && (r->name[namelen-1] == '1' || r->name[namelen-1] == '2'))
+    namelen -= 2;
+  // An unmapped read goes where its mate is, if it has one
+  if (flag & SAM_UNMAPPED)
+    pos = (flag & SAM_MATE_UNMAPPED) ? -1 : mpos;
+  record_start(b, r, namelen, flag, pos, mapq, cigar);
+  reserve(b, 64);
+  if (flag & SAM_MATE_UNMAPPED) {
+    if (flag & SAM_UNMAPPED)
+      put_lit(b, "\t*\t0\t0");
+    else {
+      // And so its mate goes here too
+      put_lit(b, "\t=\t");
+      put_uint(b, pos + 1);
+      put_lit(b, "\t0");
+    }
+  }
+  else {
+    put_lit(b, "\t=\t");
+    put_uint(b, mpos + 1);
+    put_char(b, '\t');
+    if (tlen < 0)
+      put_char(b, '-');
+    put_uint(b, (tlen < 0) ? -tlen : tlen);
+  }
+  record_end(b, r, flag);
+}
@@ -0,0 +1,79 @@
+#ifndef _SAMOUT_H
+#define _SAMOUT_H
+
+#include <pthread.h>
+#include "stack.h"
+#include "readio.h"
+#include "bgzf.h"
+#include "sortout.h"
+
+// SAM output. Records are formatted by hand into a large buffer (one per
+// thread) and written out with a single write() whenever it fills up, so
+// nothing goes through stdio.
+
+#define SAM_PAIRED 1
+#define SAM_PROPER_PAIR 2
+#define SAM_UNMAPPED 4
+#define SAM_MATE_UNMAPPED 8
+#define SAM_REVERSE 16
+#define SAM_MATE_REVERSE 32
+#define SAM_READ1 64
+#define SAM_READ2 128
+
+typedef struct _sam_writer {
+  int fd;
+  bgzf_writer *bgzf;   // If not null, output goes through this instead
+  sorter *sort;        // If not null, records are sorted before output
+  const char *rname;   // Name of the reference sequence
+  pthread_mutex_t lock;
+} sam_writer;
+
+typedef struct _sam_buf {
+  sam_writer *w;
+  char *buf;
+  size_t len;
+  size_t cap;
+  sort_ent *ents;      // Where each record is and its sort key
+  size_t nents;
+  size_t entcap;
+} sam_buf;
+
+sam_writer *sam_open(int fd, const char *rname);
+
+// Same, but compresses the output as BGZF (see bgzf.h) using nthreads
+// threads
+sam_writer *sam_open_bgzf(int fd, const char *rname, int level, int nthreads);
+
+// Makes the output sorted by position, using at most about membytes of
+// memory before spilling to tmpdir. Must be called before sam_header.
+void sam_sort(sam_writer *w, size_t membytes, const char *tmpdir);
+
+// Writes the header; rlen is the length of the reference
+void sam_header(sam_writer *w, long long rlen, int argc, char **argv);
+
+// Finishes the output and frees the writer; all of its buffers must have
+// been destroyed first
+void sam_close(sam_writer *w);
+
+sam_buf *sam_buf_make(sam_writer *w);
+
+// Flushes and frees the buffer
+void sam_buf_destroy(sam_buf *b);
+
+void sam_flush(sam_buf *b);
+
+// Appends a record for the read r (its id is used as the name if it has
+// none). pos is 0-based; cigar is read from the top of the stack down
+// and left untouched. For reverse strand alignments the sequence and
+// quality are written reverse complemented, as SAM requires.
+void sam_record(sam_buf *b, const read_rec *r, int flag, long long pos,
+		int mapq, const stack *cigar);
+
+// The same for one of a pair of reads, whose mate is at mpos (0-based), with
+// tlen the signed length of the fragment (0 unless both are mapped). A
+// /1 or /2 on the end of the name is dropped; an unmapped read with a
+// mapped mate is put where its mate is, as SAM suggests.
+void sam_pair_record(sam_buf *b, const read_rec *r, int flag, long long pos,
+		     int mapq, const stack *cigar, long long mpos, long long tlen);
+
+#endif /* _SAMOUT_H */
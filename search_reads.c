@@ -1,41 +1,271 @@
-// Looks for potential spliced reads (reads which match forward and backwards
-// against the genome in proximity
+// Looks for back-spliced reads (the sort that circular RNAs give): reads
+// whose start lines up with the genome downstream of where their end does,
+// not too far away, with the splice between the two. Each read is seeded
+// on both strands (see find_seeds), and every pair of its seeds that is
+// back-spliced like that gives a junction; the junctions of all the reads
+// are counted up and written out at the end.
 
-// usage: search_reads seqfile indexfile readfile
+// usage: search_reads [-t threads] [-q minqual] [-a anchor] [-c maxocc]
+//                     [-d maxdist] seqfile indexfile readfile
+// Seeds are at least -a bases long (default 20) and match no more than -c
+// places (default 8); the two sides of a junction are no more than -d bases
+// apart (default 10000). readfile may be raw or FASTQ, as for single_align.
+// Each junction is written to stdout as a line of its circle's first and
+// last bases (1-based, so the back-splice joins the last to the first) and
+// how many reads cross it, in order along the genome.
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "seqindex.h"
 #include "csacak.h"
 #include "fileio.h"
-#include "rdtscll.h"
-#include <time.h>
+#include "readio.h"
+#include "seed.h"
+#include "smw.h"
+#include "packed.h"
 
-static inline unsigned char getbase(const unsigned char *str, int idx) {
-	// Gets the base at the appropriate index
-	return ((str[idx>>2])>>(2*(3-(idx&3)))) & 3;
+#define DEFAULT_ANCHOR 20
+#define DEFAULT_MAXOCC 8
+#define DEFAULT_MAXDIST 10000
+
+// Seeds and hits looked at for each strand of a read (see single_align)
+#define MAX_SEEDS 64
+#define MAX_HITS 64
+
+// The splice between two hits is looked for from up to JUNCTION_SLACK
+// bases inside either, since they may have run on past it by chance; it is
+// kept if the read then has no more than JUNCTION_MAXMIS mismatches around
+// it. Any closer together than JUNCTION_MINDIST, the hits are more likely
+// either side of an indel.
+#define JUNCTION_SLACK 8
+#define JUNCTION_MAXMIS 2
+#define JUNCTION_MINDIST 6
+
+// Junctions a read can cross and still be counted (more than that is a
+// repeat, not a circle)
+#define MAX_JUNCTIONS 4
+
+// A back-splice junction: the circle runs from acceptor to donor - 1 (in
+// the genome) and then back round to acceptor
+struct junction {
+  long long acceptor, donor;
+  long long reads;     // 0 for an empty slot
+};
+
+// The junctions found, in an open-addressed hash table (linear probing)
+// of cap slots, a power of two
+struct junctions {
+  struct junction *slot;
+  size_t n, cap;
+};
+
+static size_t junction_hash(long long acceptor, long long donor) {
+  unsigned long long h = acceptor * 0x9e3779b97f4a7c15ULL ^ donor;
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  return h ^ (h >> 29);
+}
+
+static void junctions_add(struct junctions *t, long long acceptor, long long donor, long long reads) {
+  if (2 * (t->n + 1) > t->cap) {
+    // Keep it no more than half full
+    struct junctions u = { calloc(t->cap ? 2 * t->cap : 1024, sizeof(struct junction)), 0, t->cap ? 2 * t->cap : 1024 };
+    for (size_t i = 0; i < t->cap; ++i)
+      if (t->slot[i].reads)
+	junctions_add(&u, t->slot[i].acceptor, t->slot[i].donor, t->slot[i].reads);
+    free(t->slot);
+    *t = u;
+  }
+  size_t i = junction_hash(acceptor, donor) & (t->cap - 1);
+  for (; t->slot[i].reads; i = (i + 1) & (t->cap - 1))
+    if (t->slot[i].acceptor == acceptor && t->slot[i].donor == donor) {
+      t->slot[i].reads += reads;
+      return;
+    }
+  t->slot[i].acceptor = acceptor;
+  t->slot[i].donor = donor;
+  t->slot[i].reads = reads;
+  t->n++;
+}
+
+static int junction_cmp(const void *a, const void *b) {
+  const struct junction *x = a, *y = b;
+  if (x->acceptor != y->acceptor)
+    return (x->acceptor > y->acceptor) - (x->acceptor < y->acceptor);
+  return (x->donor > y->donor) - (x->donor < y->donor);
 }
 
-// Reminder to self: buf length (i.e. maximum read length) is currently
-// hardcoded; change to a larger value (to align longer reads) or make it
-// dynamic
+// Where the read crosses from hit x back to hit y, whose diagonal is
+// before x's: the split t between them with the fewest mismatches (and
+// the likeliest splice site) is found, with pattern[..t) lined up with x
+// and pattern[t..) with y. Returns whether it had few enough mismatches;
+// the junction is then put in *acceptor and *donor.
+static int back_splice(const unsigned char *seq, long long seqlen, const unsigned char *pattern, const hit *x, const hit *y, long long *acceptor, long long *donor) {
+  const long long dx = x->pos - x->start, dy = y->pos - y->start;
+  int lo = x->end - JUNCTION_SLACK, hi = y->start + JUNCTION_SLACK;
+  if (lo <= x->start)
+    lo = x->start + 1;
+  if (hi >= y->end)
+    hi = y->end - 1;
+  if (hi < lo || dy + lo < 2 || dx + hi + 2 > seqlen)
+    return 0;
+  int mis = 0, best = -1, bt = lo, bmis = 0;
+  for (int i = lo; i < hi; ++i)
+    mis += pattern[i] <= 3 && pattern[i] != ref_base(seq, dy + i);
+  for (int t = lo; t <= hi; ++t) {
+    if (t > lo) {
+      const unsigned char c = pattern[t-1];
+      mis += (c <= 3 && c != ref_base(seq, dx + t - 1)) - (c <= 3 && c != ref_base(seq, dy + t - 1));
+    }
+    int cost = MISMATCH * mis + splice_motif(seq, dx + t, dy + t);
+    if (best < 0 || cost < best) {
+      best = cost;
+      bt = t;
+      bmis = mis;
+    }
+  }
+  if (bmis > JUNCTION_MAXMIS)
+    return 0;
+  *acceptor = dy + bt;
+  *donor = dx + bt;
+  return 1;
+}
+
+struct thread_args {
+  const fm_index *fmi;
+  const unsigned char *seq;
+  long long seqlen;
+  read_input *ri;
+  pthread_mutex_t *rlock; // Protects ri
+  int minqual, anchor;
+  long long maxocc, maxdist;
+  struct junctions found;
+  long long nread, nspliced;
+};
+
+// Adds the junctions that one strand of a read crosses to the n (up to
+// MAX_JUNCTIONS) in j, unless they're there already; returns how many
+// there then are, or MAX_JUNCTIONS + 1 if there are too many
+static int read_junctions(const struct thread_args *ta, const unsigned char *pattern, int len, long long (*j)[2], int n) {
+  seed seeds[MAX_SEEDS];
+  hit hits[MAX_HITS];
+  int nhits = find_seeds(ta->fmi, pattern, len, ta->anchor, ta->maxocc, seeds, MAX_SEEDS);
+  nhits = locate_seeds(ta->fmi, seeds, nhits, hits, MAX_HITS);
+  for (int a = 0; a < nhits; ++a)
+    for (int b = 0; b < nhits; ++b) {
+      const hit *x = &hits[a], *y = &hits[b];
+      const long long d = (x->pos - x->start) - (y->pos - y->start);
+      long long acceptor, donor;
+      if (y->start < x->end || d < JUNCTION_MINDIST || d > ta->maxdist ||
+	  !back_splice(ta->seq, ta->seqlen, pattern, x, y, &acceptor, &donor))
+	continue;
+      int k;
+      for (k = 0; k < n && (j[k][0] != acceptor || j[k][1] != donor); ++k)
+	;
+      if (k < n)
+	continue;
+      if (n == MAX_JUNCTIONS)
+	return MAX_JUNCTIONS + 1;
+      j[n][0] = acceptor;
+      j[n][1] = donor;
+      n++;
+    }
+  return n;
+}
+
+void *search_worker(void *arg) {
+  struct thread_args *ta = arg;
+  unsigned char *buf = 0, *revbuf = 0;
+  int bufcap = 0;
+  read_chunk chunk;
+  read_rec r;
+  for (;;) {
+    pthread_mutex_lock(ta->rlock);
+    int more = ri_chunk(ta->ri, &chunk);
+    pthread_mutex_unlock(ta->rlock);
+    if (!more)
+      break;
+    while (chunk_next(&chunk, &r)) {
+      long long j[MAX_JUNCTIONS][2];
+      if (r.len > bufcap) {
+	bufcap = 2 * r.len;
+	free(buf);
+	free(revbuf);
+	buf = malloc(bufcap);
+	revbuf = malloc(bufcap);
+      }
+      encode_read(&r, buf, revbuf, ta->minqual);
+      // Only one way round should line up, but there's no telling which;
+      // a junction found both ways is only counted once
+      int n = read_junctions(ta, buf, r.len, j, 0);
+      if (n <= MAX_JUNCTIONS)
+	n = read_junctions(ta, revbuf, r.len, j, n);
+      if (n && n <= MAX_JUNCTIONS) {
+	for (int k = 0; k < n; ++k)
+	  junctions_add(&ta->found, j[k][0], j[k][1], 1);
+	ta->nspliced++;
+      }
+      ta->nread++;
+    }
+    chunk_release(&chunk);
+  }
+  free(buf);
+  free(revbuf);
+  return NULL;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-t threads] [-q minqual] [-a anchor] [-c maxocc] [-d maxdist] seqfile indexfile readfile\n", prog);
+  exit(-1);
+}
+
+// readfile may be "-" to read from stdin
 
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s seqfile indexfile readfile\n", argv[0]);
-    exit(-1);
+  int opt, nthreads = 1, minqual = 0, anchor = DEFAULT_ANCHOR;
+  long long maxocc = DEFAULT_MAXOCC, maxdist = DEFAULT_MAXDIST;
+  while ((opt = getopt(argc, argv, "t:q:a:c:d:")) != -1) {
+    switch (opt) {
+    case 't':
+      nthreads = atoi(optarg);
+      if (nthreads < 1)
+	nthreads = 1;
+      break;
+    case 'q':
+      minqual = atoi(optarg);
+      break;
+    case 'a':
+      anchor = atoi(optarg);
+      if (anchor < 1)
+	anchor = 1;
+      break;
+    case 'c':
+      maxocc = atoll(optarg);
+      if (maxocc < 1)
+	maxocc = 1;
+      break;
+    case 'd':
+      maxdist = atoll(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
   }
+  if (argc - optind != 3)
+    usage(argv[0]);
   char *seqfile, *indexfile, *readfile;
-  char *buf = malloc(256*256), *revbuf = malloc(256*256);
   unsigned char *seq, c;
   fm_index *fmi;
   long long len;
   long long i;
-  FILE *sfp, *ifp, *rfp;
-  seqfile = argv[1];
-  indexfile = argv[2];
-  readfile = argv[3];
+  FILE *sfp, *ifp;
+  read_input *ri;
+  seqfile = argv[optind];
+  indexfile = argv[optind+1];
+  readfile = argv[optind+2];
   sfp = fopen(seqfile, "rb");
   if (sfp == 0) {
     fprintf(stderr, "Could not open sequence\n");
@@ -80,7 +310,7 @@ int main(int argc, char **argv) {
     seq[len/4] = c;
   }
   fclose(sfp);
-  
+
   // Open index file
   ifp = fopen(indexfile, "rb");
   if (ifp == 0) {
@@ -90,81 +320,58 @@ int main(int argc, char **argv) {
   fmi = read_index(ifp);
   fclose(ifp);
 
-  // And now we go read the index file
-  rfp = fopen(readfile, "r");
-  if (rfp == 0) {
+  // And now we go read the reads
+  ri = ri_open(readfile);
+  if (ri == 0) {
     fprintf(stderr, "Could not open reads file");
     exit(-1);
   }
-  // Read one line ("read") and try aligning it
-  
-  printf("Beginning alignment\n");
-  unsigned long long nread = 0;
-  while (!feof(rfp)) {
-    if (! fgets(buf, 256*256-1, rfp))
-      continue;
-    long long forward_pos, backward_pos;
-    long long forward_match = 0, backward_match = 0;
-    // fgets() writes the ending newline if present, so we need to remove
-    // that
-    if (buf[strlen(buf)-1] == '\n')
-      buf[strlen(buf)-1] = 0;
-    long long len = strlen(buf);
-    for (unsigned long long k = 0; k < strlen(buf); ++k)
-      revbuf[k] = buf[strlen(buf)-k-1];
-    revbuf[strlen(buf)] = 0;
-    while (len > 20 /* Replace with user-specified constant? */) {
-      // Try aligning against the end of the read (MMS)
-      long long start, end;
-      long long matched = mms(fmi, (unsigned char *)buf, len, &start, &end);
-      if (matched >= 20) {
-	// Got an anchor length of >20
-	// Print out the matches
-	//printf("\n%d anchor(s) found with length %d for read %d\n", end - start, matched, nread);
-	//for (int j = start; j < end; ++j)
-	//printf("Starting at position %d\n", unc_sa(fmi, j));
-	forward_match++;
-	len -= matched;
-	forward_pos = unc_sa(fmi, start);
-      }
-      else {
-	len -= 1; // this constant should probably be bigger than 1 for performance
-		  // reasons
-      }
-    }
-    len = strlen(revbuf);
-     while (len > 20 /* Replace with user-specified constant? */) {
-      // Try aligning against the end of the read (MMS)
-      long long start, end;
-      long long matched = mms(fmi, (unsigned char*)revbuf, len, &start, &end);
-      if (matched >= 20) {
-	// Got an anchor length of >20
-	// Print out the matches
-	//printf("\n%d anchor(s) found with length %d for read %d\n", end - start, matched, nread);
-	//for (int j = start; j < end; ++j)
-	//printf("Starting at position %d\n", unc_sa(fmi, j));
-	backward_match++;
-	len -= matched;
-	backward_pos = unc_sa(fmi, start);
-      }
-      else {
-	len -= 1; // this constant should probably be bigger than 1 for performance
-		  // reasons
-      }
-    }
-    if (forward_match && backward_match && (abs(forward_pos - backward_pos) < 10000)) {
-      printf("\nRead %llu: Aligned both forward (%lld) and backward (%lld)\n",
-             nread, forward_match, backward_match);
-      printf("At locations %lld and %lld respectively\n", forward_pos, backward_pos);
-      printf("%s\n", buf);
-    }
-
-    nread++;
+  // Each thread takes a chunk of reads at a time and keeps its own count
+  // of the junctions, which are put together at the end
+  pthread_mutex_t rlock;
+  pthread_mutex_init(&rlock, 0);
+  pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+  struct thread_args *ta = calloc(nthreads, sizeof(struct thread_args));
+  for (i = 0; i < nthreads; ++i) {
+    ta[i].fmi = fmi;
+    ta[i].seq = seq;
+    ta[i].seqlen = len;
+    ta[i].ri = ri;
+    ta[i].rlock = &rlock;
+    ta[i].minqual = minqual;
+    ta[i].anchor = anchor;
+    ta[i].maxocc = maxocc;
+    ta[i].maxdist = maxdist;
+    pthread_create(&threads[i], NULL, search_worker, &ta[i]);
   }
-  fclose(rfp);
-  
-  free(buf);
-  free(revbuf);
+  struct junctions all = { 0, 0, 0 };
+  long long nread = 0, nspliced = 0;
+  for (i = 0; i < nthreads; ++i) {
+    pthread_join(threads[i], NULL);
+    for (size_t k = 0; k < ta[i].found.cap; ++k)
+      if (ta[i].found.slot[k].reads)
+	junctions_add(&all, ta[i].found.slot[k].acceptor, ta[i].found.slot[k].donor, ta[i].found.slot[k].reads);
+    free(ta[i].found.slot);
+    nread += ta[i].nread;
+    nspliced += ta[i].nspliced;
+  }
+  free(threads);
+  free(ta);
+  pthread_mutex_destroy(&rlock);
+  ri_close(ri);
+
+  // Squeezed to the front of the table, which is then no use as one
+  size_t n = 0;
+  for (size_t k = 0; k < all.cap; ++k)
+    if (all.slot[k].reads)
+      all.slot[n++] = all.slot[k];
+  if (n)
+    qsort(all.slot, n, sizeof(struct junction), junction_cmp);
+  for (size_t k = 0; k < n; ++k)
+    printf("%lld\t%lld\t%lld\n", all.slot[k].acceptor + 1, all.slot[k].donor, all.slot[k].reads);
+  fprintf(stderr, "%lld of %lld reads back-spliced, at %zu junctions\n", nspliced, nread, n);
+
+  free(all.slot);
   destroy_fmi(fmi);
   free(seq);
   return 0;
@@ -0,0 +1,310 @@
+// Seeding: finding the exact matches between a read and the genome that
+// its alignments are then built around.
+
+// The index only searches backwards along the pattern, so SMEMs are found
+// from the end of the pattern back. The longest match ending at e, say
+// [s, e), is found by backward search; it is an SMEM, and the next one
+// back ends at the last place before e that a match can reach from before
+// s (so the match from s - 1 is what we look for; if it reaches some end,
+// it reaches any earlier one too, so that can be searched for). That match
+// is then carried on backwards as far as it goes, and so on. A bidirectional
+// index would let the match from s - 1 be extended forwards directly, but
+// we don't have one, so each try at an end is a backward search of its own;
+// those are most of the work.
+
+#include <stddef.h>
+#include <stdlib.h>
+#include "seqindex.h"
+#include "seed.h"
+
+// How many of the hits before it (along the read) are looked at for the
+// one before each hit in a chain
+#define CHAIN_LOOKBACK 32
+
+// What jumping forward along the genome over an intron costs a chain,
+// however long the intron is
+#define INTRON_COST 8
+
+// The matches of the single base c
+static inline void single(const fm_index *fmi, unsigned char c, long long *sp, long long *ep) {
+  *sp = fmi->C[c];
+  *ep = fmi->C[c+1];
+}
+
+// Extends the matches [*sp, *ep) of pattern[i..e) backwards, one base at a
+// time, for as long as there are any but not past lo; returns where they
+// then start
+static int back(const fm_index *fmi, const unsigned char *pattern, int lo, int i, long long *sp, long long *ep) {
+  for (; i > lo; --i) {
+    unsigned char c = pattern[i-1];
+    if (c > 3)
+      break;
+    long long s = fmi->C[c] + rank(fmi, c, *sp), e = fmi->C[c] + rank(fmi, c, *ep);
+    if (e <= s)
+      break;
+    *sp = s;
+    *ep = e;
+  }
+  return i;
+}
+
+int find_smems(const fm_index *fmi, const unsigned char *pattern, int len, int minlen, long long maxocc, seed *out, int max) {
+  int n = 0, e = len, s;
+  long long sp, ep;
+  if (minlen < 1)
+    minlen = 1;
+  for (;;) {
+    while (e > 0 && pattern[e-1] > 3)
+      --e;
+    if (e < minlen)
+      break;
+    single(fmi, pattern[e-1], &sp, &ep);
+    s = back(fmi, pattern, 0, e - 1, &sp, &ep);
+    for (;;) {
+      // [s, e) can't be extended either way, or it would have been
+      if (e - s >= minlen && ep - sp <= maxocc && n < max) {
+	out[n].start = s;
+	out[n].end = e;
+	out[n].sp = sp;
+	out[n].ep = ep;
+	n++;
+      }
+      if (s == 0 || pattern[s-1] > 3) {
+	// Nothing can cross s - 1, so start again from there
+	e = s - 1;
+	break;
+      }
+      // The last end (before e) that pattern[s-1..] reaches; it reaches s
+      // at least. Every match ending after that starts at s or later, so
+      // is inside [s, e). The end is usually only a little way past s, so
+      // it is found by galloping up from there, then a binary search.
+      int lo = s, hi = e - 1, step = 1;
+      single(fmi, pattern[s-1], &sp, &ep);
+      while (lo < hi) {
+	int mid = (step < hi - lo) ? lo + step : hi;
+	long long msp, mep;
+	single(fmi, pattern[mid-1], &msp, &mep);
+	if (back(fmi, pattern, s - 1, mid - 1, &msp, &mep) == s - 1) {
+	  lo = mid;
+	  sp = msp;
+	  ep = mep;
+	  step *= 2;
+	}
+	else {
+	  hi = mid - 1;
+	  step = (mid - lo) / 2;
+	  if (step < 1)
+	    step = 1;
+	}
+      }
+      e = lo;
+      if (e < minlen)
+	break;
+      s = back(fmi, pattern, 0, s - 1, &sp, &ep);
+    }
+  }
+  // They were found back to front
+  for (int i = 0; i < n / 2; ++i) {
+    seed t = out[i];
+    out[i] = out[n-1-i];
+    out[n-1-i] = t;
+  }
+  return n;
+}
+
+// A seed with more matches than maxocc is tried again from its middle: the
+// longest match ending there may reach further back in some of the places
+// it occurs, and so be rare enough to use. Since chance matches are so
+// common in repeats, it also has to be at least twice minlen. Returns
+// whether one was found (in *out).
+static int reseed(const fm_index *fmi, const unsigned char *pattern, int s, int e, int minlen, long long maxocc, seed *out) {
+  int mid = (s + e) / 2, start;
+  long long sp, ep;
+  single(fmi, pattern[mid-1], &sp, &ep);
+  start = back(fmi, pattern, 0, mid - 1, &sp, &ep);
+  if (mid - start < 2 * minlen || ep - sp > maxocc)
+    return 0;
+  out->start = start;
+  out->end = mid;
+  out->sp = sp;
+  out->ep = ep;
+  return 1;
+}
+
+int find_seeds(const fm_index *fmi, const unsigned char *pattern, int len, int minlen, long long maxocc, seed *out, int max) {
+  int n = 0, e = len, s;
+  long long sp, ep;
+  if (minlen < 1)
+    minlen = 1;
+  while (e >= minlen) {
+    if (pattern[e-1] > 3) {
+      --e;
+      continue;
+    }
+    single(fmi, pattern[e-1], &sp, &ep);
+    s = back(fmi, pattern, 0, e - 1, &sp, &ep);
+    if (e - s >= minlen && ep - sp <= maxocc && n < max) {
+      out[n].start = s;
+      out[n].end = e;
+      out[n].sp = sp;
+      out[n].ep = ep;
+      n++;
+    }
+    else if (e - s >= 2 * minlen && n < max)
+      n += reseed(fmi, pattern, s, e, minlen, maxocc, &out[n]);
+    // pattern[s-1] is (most likely) a mismatch, so skip it
+    e = s - 1;
+  }
+  for (int i = 0; i < n / 2; ++i) {
+    seed t = out[i];
+    out[i] = out[n-1-i];
+    out[n-1-i] = t;
+  }
+  return n;
+}
+
+int partition_seeds(const fm_index *fmi, const unsigned char *pattern, int len, int k, long long maxocc, seed *out) {
+  int n = 0;
+  for (int i = 0; i <= k; ++i) {
+    int s = i * len / (k + 1), e = (i + 1) * len / (k + 1), j;
+    long long sp, ep;
+    // A part with an N in it has an error in it already (and loc_search
+    // can't take one)
+    for (j = s; j < e && pattern[j] <= 3; ++j)
+      ;
+    if (e == s || j < e)
+      continue;
+    loc_search(fmi, pattern + s, e - s, &sp, &ep);
+    if (ep > sp && ep - sp <= maxocc) {
+      out[n].start = s;
+      out[n].end = e;
+      out[n].sp = sp;
+      out[n].ep = ep;
+      n++;
+    }
+  }
+  return n;
+}
+
+int locate_seeds(const fm_index *fmi, const seed *seeds, int nseeds, hit *hits, int max) {
+  long long pos[max];
+  int n = 0;
+  for (int i = 0; i < nseeds && n < max; ++i) {
+    int k = locate_range(fmi, seeds[i].sp, seeds[i].ep, max - n, pos);
+    for (int j = 0; j < k; ++j) {
+      hits[n].start = seeds[i].start;
+      hits[n].end = seeds[i].end;
+      hits[n].pos = pos[j];
+      n++;
+    }
+  }
+  return n;
+}
+
+static inline long long diagonal(const hit *h) {
+  return h->pos - h->start;
+}
+
+static int diagonal_cmp(const void *a, const void *b) {
+  long long x = diagonal(a), y = diagonal(b);
+  if (x != y)
+    return (x > y) - (x < y);
+  return ((const hit *)a)->start - ((const hit *)b)->start;
+}
+
+static int start_cmp(const void *a, const void *b) {
+  const hit *x = a, *y = b;
+  if (x->start != y->start)
+    return x->start - y->start;
+  return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+static int group_cmp(const void *a, const void *b) {
+  return ((const int *)b)[0] - ((const int *)a)[0];
+}
+
+// Chaining: the hits are sorted by diagonal, which splits them into groups
+// that can't be chained with each other (since a chain never moves more than
+// maxgap between diagonals). In each group, sorted along the read, the best
+// chain ending at each hit is then the best one ending at one of the hits
+// shortly before it, plus whatever it adds. Introns widen the groups to
+// maxintron.
+int chain_hits(hit *hits, int nhits, int maxgap, int maxintron, chain *chains, int max, hit *out) {
+  if (!nhits)
+    return 0;
+  int score[nhits], prev[nhits], groups[nhits][2];
+  int ngroups = 0, nchains = 0, nout = 0;
+  const int apart = (maxintron > maxgap) ? maxintron : maxgap;
+  qsort(hits, nhits, sizeof(hit), diagonal_cmp);
+  for (int g = 0, h; g < nhits; g = h) {
+    for (h = g + 1; h < nhits && diagonal(&hits[h]) - diagonal(&hits[h-1]) <= apart; ++h)
+      ;
+    qsort(hits + g, h - g, sizeof(hit), start_cmp);
+    int best = g;
+    for (int i = g; i < h; ++i) {
+      const hit *x = &hits[i];
+      score[i] = x->end - x->start;
+      prev[i] = -1;
+      for (int j = (i - g > CHAIN_LOOKBACK) ? i - CHAIN_LOOKBACK : g; j < i; ++j) {
+	const hit *y = &hits[j];
+	long long d = diagonal(x) - diagonal(y);
+	if (d < 0)
+	  d = -d;
+	if (y->start >= x->start || y->end >= x->end || y->pos >= x->pos ||
+	    y->pos + (y->end - y->start) >= x->pos + (x->end - x->start))
+	  continue;
+	if (d > maxgap) {
+	  // Only ever forwards over an intron
+	  if (diagonal(x) < diagonal(y) || d > maxintron)
+	    continue;
+	  d = INTRON_COST;
+	}
+	int sc = score[j] + x->end - ((y->end > x->start) ? y->end : x->start) - d;
+	if (sc > score[i]) {
+	  score[i] = sc;
+	  prev[i] = j;
+	}
+      }
+      if (score[i] > score[best])
+	best = i;
+    }
+    groups[ngroups][0] = score[best];
+    groups[ngroups][1] = best;
+    ngroups++;
+  }
+  qsort(groups, ngroups, sizeof(groups[0]), group_cmp);
+
+  for (int c = 0; c < ngroups && nchains < max; ++c) {
+    // Back from the last hit, trimming each against the one after it
+    // (which is never moved by trimming, since only ends are trimmed);
+    // anything trimmed away completely is dropped
+    int n = 0, i;
+    for (i = groups[c][1]; i >= 0; i = prev[i])
+      n++;
+    hit *o = out + nout + n;
+    const hit *next = 0;
+    for (i = groups[c][1]; i >= 0; i = prev[i]) {
+      hit x = hits[i];
+      if (next) {
+	if (x.end > next->start)
+	  x.end = next->start;
+	long long over = x.pos + (x.end - x.start) - next->pos;
+	if (over > 0)
+	  x.end -= over;
+	if (x.end <= x.start)
+	  continue;
+      }
+      *--o = x;
+      next = o;
+    }
+    n = out + nout + n - o;
+    for (i = 0; i < n; ++i)
+      out[nout + i] = o[i];
+    chains[nchains].first = nout;
+    chains[nchains].n = n;
+    chains[nchains].score = groups[c][0];
+    nchains++;
+    nout += n;
+  }
+  return nchains;
+}
@@ -0,0 +1,70 @@
+#ifndef _SEED_H
+#define _SEED_H
+
+#include "seqindex.h"
+
+// Seeds for a read: exact matches between part of it and the genome
+typedef struct _seed {
+  int start, end;     // The part of the read matched, [start, end)
+  long long sp, ep;   // Its matches, as a range of the suffix array (see
+                      // loc_search)
+} seed;
+
+// Finds the super-maximal exact matches of pattern (the exact matches that
+// are not part of any longer one; Ns never match) that are at least minlen
+// long and occur no more than maxocc times, in one pass from the end of the
+// pattern. Up to max of them are stored in out, in order along the pattern;
+// returns how many there were.
+int find_smems(const fm_index *fmi, const unsigned char *pattern, int len, int minlen, long long maxocc, seed *out, int max);
+
+// A cheaper set of seeds: the longest match ending at the end of the
+// pattern, then the longest ending just before the base that that one
+// stopped at, and so on. Those stops are usually mismatches, so this finds
+// the same seeds as find_smems on reads that differ from the genome in only
+// a few places, at a fraction of the cost; it can miss SMEMs that overlap
+// each other, though. Takes the same arguments as find_smems, except that
+// a seed with more than maxocc matches is re-seeded from its middle (see
+// reseed in seed.c) rather than just dropped; the seeds are in order of
+// where they end.
+int find_seeds(const fm_index *fmi, const unsigned char *pattern, int len, int minlen, long long maxocc, seed *out, int max);
+
+// Pigeonhole seeds: pattern is split into k + 1 parts of (nearly) equal
+// length, each of which is searched for exactly. Any placement of the
+// pattern with no more than k differences has to match one of them
+// exactly, so it is found through them, as long as that part has no more
+// than maxocc matches and no N. out needs room for k + 1 seeds; returns how
+// many had any matches.
+int partition_seeds(const fm_index *fmi, const unsigned char *pattern, int len, int k, long long maxocc, seed *out);
+
+// A seed located in the genome: pattern[start..end) matches the genome
+// from pos on
+typedef struct _hit {
+  int start, end;
+  long long pos;
+} hit;
+
+// Locates every match of each of the seeds (see locate_range); stores up to
+// max hits, and returns how many there were. A seed with more matches than
+// there is room left for gets a sample of them.
+int locate_seeds(const fm_index *fmi, const seed *seeds, int nseeds, hit *hits, int max);
+
+// A set of hits that could all be part of the same alignment: in order
+// along both the read and the genome, and on diagonals (pos - start) no
+// more than maxgap apart from one to the next, unless the genome skips
+// forward over an intron (of up to maxintron bases; see chain_hits) between
+// them. Its score is how much of the read it covers, less the gaps (and a
+// fixed amount for each intron) it would need.
+typedef struct _chain {
+  int first, n;       // Its hits are out[first..first+n) (see chain_hits)
+  int score;
+} chain;
+
+// Finds the best chain among the hits that are close enough to each other
+// to be chained together at all, for up to max such groups, best first.
+// Their hits go into out (which needs room for nhits), in order along the
+// read and trimmed so that neither their parts of the read nor of the
+// genome overlap. hits is sorted in the process. Returns how many chains
+// there were. A maxintron no more than maxgap allows no introns.
+int chain_hits(hit *hits, int nhits, int maxgap, int maxintron, chain *chains, int max, hit *out);
+
+#endif /* _SEED_H */
@@ -10,8 +10,11 @@
 #include <stddef.h>
 #include "seqindex.h"
 #include "csacak.h"
+#include "packed.h"
 
 static inline unsigned char getbase(const unsigned char *str, long long idx) {
+  if (idx < 0)
+    idx = 0;
   // Gets the base at the appropriate index
   return ((str[idx>>2])>>(2*(3-(idx&3)))) & 3;
 }
@@ -250,6 +253,46 @@ long long unc_sa(const fm_index *fmi, long long idx) {
   return x;
 }
 
+// How many rows locate_range walks back at once. Each LF step is a couple
+// of cache misses that depend on each other, but the steps of different rows
+// don't, so walking enough of them together lets those misses overlap.
+#define LOCATE_LANES 16
+
+long long locate_range(const fm_index *fmi, long long sp, long long ep, long long max, long long *pos) {
+  long long n = ep - sp, m = (n < max) ? n : max;
+  for (long long k0 = 0; k0 < m; k0 += LOCATE_LANES) {
+    long long idx[LOCATE_LANES];
+    int steps[LOCATE_LANES], lanes = (m - k0 < LOCATE_LANES) ? m - k0 : LOCATE_LANES;
+    int l, left;
+    for (l = 0; l < lanes; ++l) {
+      // Spread evenly over the interval if it has to be cut down
+      idx[l] = (m < n) ? sp + (k0 + l) * n / m : sp + k0 + l;
+      steps[l] = 0;
+    }
+    do {
+      left = 0;
+      for (l = 0; l < lanes; ++l)
+	if (idx[l] & 31) {
+	  __builtin_prefetch(fmi->bwt + (idx[l] >> 2));
+	  __builtin_prefetch(fmi->rank_index[idx[l] / 16]);
+	  left = 1;
+	}
+      for (l = 0; l < lanes; ++l)
+	if (idx[l] & 31) {
+	  idx[l] = lf(fmi, idx[l]);
+	  steps[l]++;
+	}
+    } while (left);
+    for (l = 0; l < lanes; ++l) {
+      long long x = fmi->idxs[idx[l]/32] + steps[l];
+      if (x > fmi->len)
+	x -= fmi->len + 1;
+      pos[k0 + l] = x;
+    }
+  }
+  return m;
+}
+
 // Runs in O(log_c(n) + m) time
 long long locate(const fm_index *fmi, const unsigned char *pattern, long long len) {
   // Find the (first[0]) instance of a given sequence in a given fm-index
@@ -304,16 +347,181 @@ void loc_search(const fm_index *fmi, const unsigned char *pattern, long long len
   *ep = end;
 }
 
+// Approximate backward search. Going back along the pattern, each step
+// either matches the next base (or substitutes another for it), skips it
+// (an insertion in the pattern), or takes a base from the genome without
+// using one (a deletion). That branches a lot, so each branch is given up
+// as soon as the differences left can't cover what is left of the pattern:
+// D[i] is a lower bound for the differences that pattern[0..i] needs.
+// It's found from the end of each prefix: if pattern[z..i] doesn't occur,
+// that part needs a difference of its own, on top of D[z-1] for the rest
+// (and a prefix never needs fewer than a shorter one). Searching back
+// from each i is cut off after LOWER_BOUND_SPAN bases, since the lower
+// bound is still right without going any further.
+#define LOWER_BOUND_SPAN 32
+
+// rank() for all four bases at once, for when every one of them is wanted
+static void rank_all(const fm_index *fmi, long long idx, long long *r) {
+  if (idx > fmi->endloc)
+    idx--;
+  const long long *x = fmi->rank_index[idx/16];
+  long long i;
+  r[0] = x[0];
+  r[1] = x[1];
+  r[2] = x[2];
+  r[3] = x[3];
+  for (i = (idx/16)*4; i < idx/4; i++) {
+    const unsigned char *t = fmi->lookup + 4 * fmi->bwt[i];
+    r[0] += t[0];
+    r[1] += t[1];
+    r[2] += t[2];
+    r[3] += t[3];
+  }
+  for (i = 0; i < idx % 4; ++i)
+    r[getbase(fmi->bwt, (idx & ~3LL) + i)]++;
+}
+
+struct ksearch {
+  const fm_index *fmi;
+  const unsigned char *pattern;
+  const int *D;
+  long long len;
+  int k;
+  kmatch *out;
+  int n, max;
+};
+
+static void lower_bounds(const fm_index *fmi, const unsigned char *pattern, long long len, int *D) {
+  for (long long i = 0; i < len; ++i) {
+    long long sp = 0, ep = fmi->C[4], j;
+    D[i] = i ? D[i-1] : 0;
+    for (j = i; j >= 0 && j > i - LOWER_BOUND_SPAN && pattern[j] <= 3; --j) {
+      const unsigned char c = pattern[j];
+      sp = fmi->C[c] + rank(fmi, c, sp);
+      ep = fmi->C[c] + rank(fmi, c, ep);
+      if (ep <= sp) {
+	const int d = (j ? D[j-1] : 0) + 1;
+	if (d > D[i])
+	  D[i] = d;
+	break;
+      }
+    }
+  }
+}
+
+// pattern[0..i] is left to match, from [sp, ep), with z differences to spare.
+// An insertion next to a deletion is never tried, since a substitution (or
+// a match) does the same for less; last is what the step before was (see
+// below).
+enum { K_MATCH, K_INS, K_DEL };
+
+static void search_k(struct ksearch *ks, long long i, long long sp, long long ep, int z, int last) {
+  const fm_index *fmi = ks->fmi;
+  if (i < 0) {
+    // The same interval can be reached by different sets of differences,
+    // so it's only kept once (with the fewest), leaving room for the rest
+    for (int j = 0; j < ks->n; ++j)
+      if (ks->out[j].sp == sp && ks->out[j].ep == ep) {
+	if (ks->k - z < ks->out[j].diffs)
+	  ks->out[j].diffs = ks->k - z;
+	return;
+      }
+    if (ks->n < ks->max) {
+      ks->out[ks->n].sp = sp;
+      ks->out[ks->n].ep = ep;
+      ks->out[ks->n].diffs = ks->k - z;
+      ks->n++;
+    }
+    return;
+  }
+  if (z < ks->D[i])
+    return;
+  const unsigned char b = ks->pattern[i];
+  // Whether there's room for a difference at pattern[i] (a substitution or
+  // insertion), or for a deletion after it (but not off the end of the
+  // pattern, which would only make a match worse); if neither, pattern[i]
+  // just has to match
+  const int sub = z && (!i || z - 1 >= ks->D[i-1]);
+  const int del = z && z - 1 >= ks->D[i] && i < ks->len - 1 && last != K_INS;
+  if (sub && last != K_DEL)
+    search_k(ks, i - 1, sp, ep, z - 1, K_INS);
+  long long rs[4], re[4];
+  if (sub || del || b > 3) {
+    rank_all(fmi, sp, rs);
+    rank_all(fmi, ep, re);
+  }
+  else {
+    rs[b] = rank(fmi, b, sp);
+    re[b] = rank(fmi, b, ep);
+  }
+  for (unsigned char c = 0; c < 4; ++c) {
+    const int cost = (b <= 3 && b != c);
+    if (cost && !sub && !del)
+      continue;
+    long long s = fmi->C[c] + rs[c], e = fmi->C[c] + re[c];
+    if (e <= s)
+      continue;
+    if (!cost || sub)
+      search_k(ks, i - 1, s, e, z - cost, K_MATCH);
+    if (del)
+      search_k(ks, i, s, e, z - 1, K_DEL);
+  }
+}
+
+static int kmatch_cmp(const void *a, const void *b) {
+  const kmatch *x = a, *y = b;
+  if (x->sp != y->sp)
+    return (x->sp > y->sp) - (x->sp < y->sp);
+  if (x->ep != y->ep)
+    return (x->ep > y->ep) - (x->ep < y->ep);
+  return x->diffs - y->diffs;
+}
+
+int loc_search_k(const fm_index *fmi, const unsigned char *pattern, long long len, int k, kmatch *out, int max) {
+  int D[len];
+  struct ksearch ks = {fmi, pattern, D, len, k, out, 0, max};
+  if (len <= 0)
+    return 0;
+  lower_bounds(fmi, pattern, len, D);
+  search_k(&ks, len - 1, 0, fmi->C[4], k, K_MATCH);
+  qsort(out, ks.n, sizeof(kmatch), kmatch_cmp);
+  return ks.n;
+}
+
+// How many bases going back from pattern[n-1] match the sequence going back
+// from pos - 1 (N matching anything), comparing 32 bases at a time; the
+// first difference is the lowest set bit once they are XORed
+static long long match_back(const unsigned char *seq, long long pos, const unsigned char *pattern, long long n) {
+  long long k = 0, lim = (n < pos) ? n : pos;
+  while (k < lim) {
+    const int m = (lim - k < 32) ? lim - k : 32;
+    unsigned long long care, x = read_word(pattern + n - k - m, m, &care);
+    x = (x ^ seq_word(seq, pos - k - m, m)) & care;
+    if (x)
+      return k + (__builtin_ctzll(x) - (64 - 2 * m)) / 2;
+    k += m;
+  }
+  return k;
+}
+
 // Finds the maximum mappable suffix of the pattern; returns the length
 // matched (starting at the end of the pattern) and stores the range
-// of matches in sp and ep.
-long long mms(const fm_index *fmi, const unsigned char *pattern, long long len, long long *sp, long long *ep) {
+// of matches in sp and ep. Given seq, once that range is down to a single
+// match at least minlen long we stop there and compare instead.
+long long mms_seq(const fm_index *fmi, const unsigned char *seq, const unsigned char *pattern, long long len, long long minlen, long long *sp, long long *ep, long long *pos) {
   long long start, end, i;
   int skips = 0;
-  while (pattern[len-1] == 5) {
+  *pos = -1;
+  while (len > 0 && pattern[len-1] == 5) {
     len--;
     skips++;
   }
+  if (len <= 0) {
+    // Nothing but Ns (or nothing at all), which match anything
+    *sp = 0;
+    *ep = fmi->C[4];
+    return skips;
+  }
   start = fmi->C[pattern[len-1]];
   end = fmi->C[pattern[len-1]+1];
   for (i = len-2; i >= 0; --i) {
@@ -322,6 +530,16 @@ long long mms(const fm_index *fmi, const unsigned char *pattern, long long len,
     }
     *sp = start;
     *ep = end;
+    if (seq && end - start == 1 && len - i - 1 + skips >= minlen) {
+      // pattern[i+1..len) only occurs in the one place, so the rest is
+      // just a comparison against the sequence, which is much cheaper than
+      // carrying on with rank(). (Finding that place isn't cheap either,
+      // which is why we wait for minlen; the caller would want it found
+      // by then anyway.)
+      long long p = unc_sa(fmi, start), k = match_back(seq, p, pattern, i + 1);
+      *pos = p - k;
+      return len - i - 1 + k + skips;
+    }
     unsigned char c = pattern[i];
     if (c == 5) {
       // Assume it's the "most likely" one (the one with most matches)
@@ -342,10 +560,17 @@ long long mms(const fm_index *fmi, const unsigned char *pattern, long long len,
   else { // Finished matching
     *sp = start;
     *ep = end;
+    if (seq && end - start == 1 && len - i - 1 + skips >= minlen)
+      *pos = unc_sa(fmi, start);
     return len - i - 1 + skips;
   }
 }
 
+long long mms(const fm_index *fmi, const unsigned char *pattern, long long len, long long *sp, long long *ep) {
+  long long pos;
+  return mms_seq(fmi, 0, pattern, len, 0, sp, ep, &pos);
+}
+
 // Prlong longs part of a compressed sequence in more human readable format
 void printseq(const unsigned char *seq, long long startidx, long long len) {
   const unsigned char nts[4] = {'A', 'C', 'G', 'T'};
@@ -354,3 +579,144 @@ void printseq(const unsigned char *seq, long long startidx, long long len) {
   }
   putchar('\n');
 }
+
+// Continues a MMS search
+int mms_continue(const fm_index *fmi, const unsigned char *pattern, int len, int *sp, int *ep) {
+  int start, end, i;
+  start = *sp;
+  end = *ep;
+  for (i = len-1; i >= 0; --i) {
+    if (end <= start) {
+      break;
+    }
+    *sp = start;
+    *ep = end;
+    start = fmi->C[(ptrdiff_t)pattern[i]] + rank(fmi, pattern[i], start);
+    end = fmi->C[(ptrdiff_t)pattern[i]] + rank(fmi, pattern[i], end);
+  }
+  if (end <= start) // Didn't finish matching
+    return len - i - 2;
+  else { // Finished matching
+    *sp = start;
+    *ep = end;
+    return len - i - 1;
+  }
+}
+
+// Tries continuing a mms search with mismatch; returns upon finding any continuation with at least 6 matching nts
+// Last argument is the difference between the return value and the number of nts on the genome matched (from -3 to 3).
+// Gives up (returning -1) if there are more than maxocc matches to continue from
+int mms_mismatch(const fm_index *fmi, const unsigned char *seq, const unsigned char *pattern, int len, long long int *sp, long long int *ep, long long maxocc, int *genomeskips) {
+  // If there are too many matches, don't even bother
+  if (*ep - *sp > maxocc)
+    return -1;
+  if (len < 2) { // nothing to do, really
+    int loc = unc_sa(fmi, *sp);
+    unsigned char sub_c = getbase(seq, loc-1);
+    *sp = fmi->C[(ptrdiff_t)sub_c] + rank(fmi, sub_c, *sp);
+    *ep = *sp + 1;
+    *genomeskips = 0;
+    return 1;
+  }
+  int best_align = 0;
+  int best_pos = -1;
+  long long locs[16]; // Located 16 at a time, since we usually stop early
+  for (long long int i = *sp; i < *ep; ++i) {
+    if (!((i - *sp) & 15))
+      locate_range(fmi, i, (*ep - i > 16) ? i + 16 : *ep, 16, locs);
+    // Reads the start and end from sp and ep instead of using the last
+    // character of the sequence. It assumes that we have a mismatch at that
+    // point (mms returns if that happens or it finished)
+    // and tries the following things to try aligning it
+    
+    // 1) Assume that there was a substitution at that point. Use LF() to skip
+    // to the next nt and decrement len, then try aligning
+    {
+      int loc = locs[(i - *sp) & 15];
+      char sub_c = getbase(seq, loc-1);
+      int sub_idx = fmi->C[(ptrdiff_t)sub_c] + rank(fmi, sub_c, i), ins_idx = sub_idx;
+      int sub_end = sub_idx + 1, sub_align;
+      sub_align = mms_continue(fmi, pattern, len-1, &sub_idx, &sub_end) + 1;
+      best_align = sub_align;
+      best_pos = sub_idx;
+      if (sub_align > 6 || sub_align == len) {
+	*genomeskips = 0;
+	break;
+      }
+
+      // 1.5) Assume that there was an insertion (on the genome) at that point of up to three nts
+      // Use LF() to skip one, two, and three nts and _don't_ decrement len, then try aligning for each of those
+      int bleh = ins_idx;
+
+      int ins_end = ins_idx + 1, ins_align;
+      ins_align = mms_continue(fmi, pattern, len, &ins_idx, &ins_end);
+      if (ins_align > 5 || ins_align == len) {
+	best_align = sub_align;
+	best_pos = sub_idx;
+	*genomeskips = 1;
+	break;
+      }
+
+      // two!
+      sub_c = getbase(seq, loc-2);
+      ins_idx = fmi->C[(ptrdiff_t)sub_c] + rank(fmi, sub_c, bleh);
+      int blah = ins_idx;
+      ins_align = mms_continue(fmi, pattern, len, &ins_idx, &ins_end);
+      if (ins_align > 5 || ins_align == len) {
+	best_align = sub_align;
+	best_pos = sub_idx;
+	*genomeskips = 2;
+	break;
+      }
+
+      // three!
+      sub_c = getbase(seq, loc-3);
+      ins_idx = fmi->C[(ptrdiff_t)sub_c] + rank(fmi, sub_c, blah);
+      ins_align = mms_continue(fmi, pattern, len, &ins_idx, &ins_end);
+      if (ins_align > 5 || ins_align == len) {
+	best_align = sub_align;
+	best_pos = sub_idx;
+	*genomeskips = 3;
+	break;
+      }
+    }
+    
+    // 2) Assume that there was a deletion (on the genome) at that point.
+    // Ignore up to three nts and start aligning again
+    {
+      // This one is a lot simpler because we don't actually need to
+      // figure out the character
+      int del_idx = i, del_end = del_idx + 1, del_align;
+      del_align = mms_continue(fmi, pattern, len-1, &del_idx, &del_end) + 1;
+      if (del_align > 6 || del_align == len) {
+	best_align = del_align;
+	best_pos = del_idx;
+	*genomeskips = -1;
+	break;
+      }
+
+      del_idx = i;
+      del_end = del_idx + 1;
+      del_align = mms_continue(fmi, pattern, len-2, &del_idx, &del_end) + 2;
+      if (del_align > 7 || del_align == len) {
+	best_align = del_align;
+	best_pos = del_idx;
+	*genomeskips = -2;
+	break;
+      }
+
+      del_idx = i;
+      del_end = del_idx + 1;
+      del_align = mms_continue(fmi, pattern, len-3, &del_idx, &del_end) + 3;
+      if (del_align > 8 || del_align == len) {
+	best_align = del_align;
+	best_pos = del_idx;
+	*genomeskips = -3;
+	break;
+      }
+    }
+  }
+  *sp = best_pos;
+  *ep = best_pos + 1;
+  return best_align;
+}
@@ -48,6 +48,12 @@ long long reverse_search(const fm_index *fmi, const unsigned char *pattern, long
 // Calculates SA[idx] from the FM-index
 long long unc_sa(const fm_index *fmi, long long idx);
 
+// Calculates SA[idx] for every row of [sp, ep) at once, which is much
+// faster than calling unc_sa for each of them. If there are more than max
+// rows only max of them, spread evenly over the interval, are located.
+// The positions go in pos, in order of row; returns how many there were.
+long long locate_range(const fm_index *fmi, long long sp, long long ep, long long max, long long *pos);
+
 // Same as reverse_search
 long long locate(const fm_index *fmi, const unsigned char *pattern, long long len);
 
@@ -59,6 +65,38 @@ void loc_search(const fm_index *fmi, const unsigned char *pattern, long long len
 // of bases matched, storing matches in sp and ep as per loc_search
 long long mms(const fm_index *fmi, const unsigned char *pattern, long long len, long long *sp, long long *ep);
 
+// The same, given the (packed) sequence as well: once the matches are down
+// to one (and at least minlen long), the rest is found by comparing the
+// pattern against the sequence there, rather than with two rank() calls a
+// base. In that case the match's position in the sequence goes in pos (and
+// sp and ep should not be used); otherwise pos is -1.
+long long mms_seq(const fm_index *fmi, const unsigned char *seq, const unsigned char *pattern, long long len, long long minlen, long long *sp, long long *ep, long long *pos);
+
+// Continues a backward search of pattern from the matches [*sp, *ep);
+// returns how many more bases matched
+int mms_continue(const fm_index *fmi, const unsigned char *pattern, int len, int *sp, int *ep);
+
+// Tries carrying on an MMS search (whose matches are [*sp, *ep)) past the
+// base it stopped at, assuming a substitution or an indel of up to three
+// bases there; see seqindex.c for the details. Gives up (returning -1) if
+// there are more than maxocc matches to carry on from.
+int mms_mismatch(const fm_index *fmi, const unsigned char *seq, const unsigned char *pattern, int len, long long int *sp, long long int *ep, long long maxocc, int *genomeskips);
+
+// A set of approximate matches found by loc_search_k: the rows [sp, ep) of
+// the suffix array all match the whole pattern with diffs differences
+typedef struct _kmatch {
+  long long sp, ep;
+  int diffs;
+} kmatch;
+
+// Finds every match of the whole pattern with no more than k differences
+// (substitutions, insertions and deletions; Ns match anything), by a
+// depth-first backward search that gives up on any branch that can't be
+// finished within k (see loc_search_k in seqindex.c). Up to max of them go
+// in out, one per interval, with the fewest differences found for it;
+// returns how many there were.
+int loc_search_k(const fm_index *fmi, const unsigned char *pattern, long long len, int k, kmatch *out, int max);
+
 // Prlong longs part of a compressed sequence in human-readable form
 void printseq(const unsigned char *seq, long long startidx, long long len);
 
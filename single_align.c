@@ -1,13 +1,45 @@
 // Tries aligning reads from a file against an index and sequence read from
-// file, assuming that they are not spliced reads
+// file, assuming that they are not spliced reads (unless -i says otherwise)
 // This, of course, requires that we put another function together.
 
-// usage: single_align seqfile indexfile readfile
+// usage: single_align [-q minqual] [-t threads] [-z level] [-x xdrop]
+//                     [-c maxocc] [-k edits] [-i maxintron] [-b]
+//                     [-s [-m MB] [-T tmpdir]]
+//                     seqfile indexfile readfile [matefile]
+// readfile may be raw (one read per line) or FASTQ; with -q, FASTQ bases
+// with quality below minqual are treated as N. Alignments are written to
+// stdout as SAM, using the given number of threads; with -z the output is
+// BGZF-compressed at the given zlib level (-1 for the default), with
+// compression spread over the same number of threads.
+// With -s the output is sorted by position, holding at most about -m MB
+// (default 768) of records in memory and spilling sorted runs to -T
+// (default $TMPDIR or /tmp).
+// With -x, the ends of reads are extended with X-drop: once the alignment
+// score falls more than xdrop below the best seen the rest of the read is
+// soft-clipped instead (so junk tails, e.g. adapters, cost very little).
+// Seeds matching more than -c places (default 8) are not used as they are;
+// reads that still align equally well in more than one place get a MAPQ
+// of 0.
+// With -k, reads are seeded by splitting them into edits + 1 parts instead
+// (see partition_seeds), so that every placement with no more than that
+// many differences is found (unless a part has more than maxocc matches);
+// the candidates are checked with split_distance_within before any DP.
+// With -i, reads may be spliced: seeds up to maxintron bases further on
+// along the genome than the last are chained across an intron, which is
+// placed (see splice_fast) and written as an N in the CIGAR. Not with -k.
+// With -b, both strands are aligned at once and the better alignment kept,
+// rather than the reverse complement only being tried when the read doesn't
+// align forwards (see align_inflight).
+// With a matefile, the reads are pairs, the nth read of readfile with the
+// nth of matefile (see pair_worker).
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
 #include "seqindex.h"
 #include "csacak.h"
 #include "fileio.h"
@@ -15,296 +47,471 @@
 #include "time.h"
 #include "smw.h"
 #include "stack.h"
+#include "readio.h"
+#include "samout.h"
+#include "seed.h"
 
-static inline unsigned char getbase(const unsigned char *str, int idx) {
-  if (idx<0) idx=0;
-	// Gets the base at the appropriate index
-	return ((str[idx>>2])>>(2*(3-(idx&3)))) & 3;
+// How many matches a seed can have and still be used, unless -c says
+// otherwise
+#define DEFAULT_MAXOCC 8
+
+// Once a read has an anchor but doesn't line up with the genome around it
+// without gaps, the anchored alignment is built around chains of seeds
+// instead: up to MAX_SEEDS seeds (see find_seeds), each with no more than
+// maxocc matches, and up to MAX_HITS of their locations, of which the best
+// MAX_CHAINS chains are tried, best first
+#define MAX_SEEDS 64
+#define MAX_HITS 64
+#define MAX_CHAINS 3
+
+// How many gap bases an alignment may have (or k, with -k, if that's more)
+#define MAX_INDELS 5
+
+// With -i, how far into the hits either side of an intron its ends are
+// looked for
+#define SPLICE_SLACK 8
+
+// With -i, an end of the read that doesn't line up with the genome next to
+// the hit it's at may be an exon of its own, too short to have been seeded,
+// if it's at least SPLICE_MIN long (and shorter than SPLICE_MAX anchors,
+// since anything longer would have been seeded); it is looked for with up
+// to SPLICE_MAXMIS(n) mismatches (so that a short one is unlikely to turn
+// up anywhere in the window by chance). It has to have at least
+// SPLICE_MARGIN more than that where it is, too, or a sequencing error or
+// two near the end would be enough to send it off to any chance match.
+#define SPLICE_MIN 8
+#define SPLICE_MAX 3
+#define SPLICE_MAXMIS(n) (((n) - 4) / 10)
+#define SPLICE_MARGIN 3
+
+// align_read_anchored is done in steps, stopping at each DP, so that a
+// worker can keep lots of reads going at once and have their DP solved
+// together (see nw_queue). This is everything that has to be kept between
+// steps.
+struct anchored {
+  const unsigned char *pattern;
+  int len, olen, anchor_len, xdrop;
+  long long maxocc;
+  int k;           // For pigeonhole seeding (0 for the usual)
+  int maxintron;   // Longest intron allowed (0 for none)
+  int queue;       // Whether to queue the DP rather than doing it there and then
+  int score, indels;
+  long long curpos;
+  int anchlen;
+  int ret, clip;   // What the last nw_fast gave
+  int seeded, seedlen; // Whether anchored_exact already did SEED's first search
+  long long seedocc;
+  int nchains;     // How many chains were found (-1 until they're looked for)
+  int curchain, curhit; // The chain being aligned, and which of its hits we're on
+  chain chains[MAX_CHAINS];
+  hit chits[MAX_HITS];
+  int step;
+  long long pos;   // The result, once step is DONE (-1 if it didn't align)
+  int mapq;
+  stack *s;
+};
+
+enum { SEED, CHAIN, CHAIN_TAIL, CHAIN_GAP, HEAD, HEAD_DONE, END, END_DONE, DONE };
+
+static void anchored_start(struct anchored *a, const unsigned char *pattern, int len, int anchor_len, int xdrop, long long maxocc, int k, int maxintron, int queue, stack *s) {
+  a->pattern = pattern;
+  a->len = a->olen = len;
+  a->anchor_len = anchor_len;
+  a->xdrop = xdrop;
+  a->maxocc = maxocc;
+  a->k = k;
+  a->maxintron = k ? 0 : maxintron;
+  a->queue = queue && !xdrop;
+  a->score = -1;
+  a->curpos = -1;
+  a->seeded = 0;
+  a->nchains = -1;
+  a->step = SEED;
+  a->s = s;
 }
 
-// Continues a MMS search
-int mms_continue(const fm_index *fmi, const unsigned char *pattern, int len, int *sp, int *ep) {
-  int start, end, i;
-  start = *sp;
-  end = *ep;
-  for (i = len-1; i >= 0; --i) {
-    if (end <= start) {
-      break;
-    }
-    *sp = start;
-    *ep = end;
-    start = fmi->C[(ptrdiff_t)pattern[i]] + rank(fmi, pattern[i], start);
-    end = fmi->C[(ptrdiff_t)pattern[i]] + rank(fmi, pattern[i], end);
-  }
-  if (end <= start) // Didn't finish matching
-    return len - i - 2;
-  else { // Finished matching
-    *sp = start;
-    *ep = end;
-    return len - i - 1;
+// These return whether the DP was queued; if it wasn't, it's already done.
+// The genome is read in place (from pos on, or back from pos - 1)
+static int anchored_nw(struct anchored *a, dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *seq, long long pos, int len2, int backwards) {
+  if (a->queue)
+    return nw_queue(ws, str1, len1, seq, pos, len2, backwards, a->s, &a->score, &a->indels, &a->ret);
+  a->ret = nw_fast(ws, str1, len1, seq, pos, len2, backwards, a->s, &a->score, &a->indels, a->xdrop, &a->clip);
+  return 0;
+}
+
+static int anchored_sw(struct anchored *a, dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *seq, long long pos, int len2) {
+  if (a->queue)
+    return sw_queue(ws, str1, len1, seq, pos, len2, a->s, &a->score, &a->indels);
+  sw_fast(ws, str1, len1, seq, pos, len2, a->s, &a->score, &a->indels, a->xdrop);
+  return 0;
+}
+
+// Sets up the head (everything before the first anchor) to be aligned,
+// backwards from the anchor
+static int anchored_head(struct anchored *a, const unsigned char *seq, dp_workspace *ws) {
+  int buflen = a->len + a->indels;
+  if (buflen > a->curpos)
+    buflen = a->curpos;
+  return anchored_nw(a, ws, a->pattern, a->len, seq, a->curpos, buflen, 1);
+}
+
+// If the whole read occurs (Ns aside) in just the one place, that is its
+// alignment, and a is left DONE with it. Otherwise the search is kept,
+// since it is the one that the anchored alignment starts with anyway, so
+// trying this first costs nothing. Returns whether it was found; a should
+// have only just been started.
+static int anchored_exact(const fm_index *fmi, const unsigned char *seq, struct anchored *a) {
+  long long sp, ep;
+  int seglen = mms_seq(fmi, seq, a->pattern, a->olen, a->anchor_len, &sp, &ep, &a->curpos);
+  if (seglen < a->olen || a->curpos < 0 || a->curpos + a->olen > fmi->len) {
+    a->seeded = 1;
+    a->seedlen = seglen;
+    a->seedocc = ep - sp;
+    return 0;
   }
+  stack_push(a->s, 'M', a->olen);
+  a->pos = a->curpos;
+  a->mapq = 60;
+  a->score = (int) (0.6 * (1 + a->olen));
+  a->step = DONE;
+  return 1;
 }
 
-// Tries continuing a mms search with mismatch; returns upon finding any continuation with at least 6 matching nts
-// Last argument is the difference between the return value and the number of nts on the genome matched (from -3 to 3).
-int mms_mismatch(const fm_index *fmi, const unsigned char *seq, const unsigned char *pattern, int len, long long int *sp, long long int *ep, int *genomeskips) {
-  // If there are too many matches, don't even bother
-  //  if (*ep - *sp > 10)
-  //    return -1;
-  if (len < 2) { // nothing to do, really
-    int loc = unc_sa(fmi, *sp);
-    unsigned char sub_c = getbase(seq, loc-1);
-    *sp = fmi->C[(ptrdiff_t)sub_c] + rank(fmi, sub_c, *sp);
-    *ep = *sp + 1;
-    *genomeskips = 0;
-    return 1;
+// With pigeonhole seeding, the chains (each just hits on nearby diagonals)
+// are candidates, which are kept only if the read lines up with the genome
+// there with no more than k differences; the best of those, with the fewest
+// differences, are kept in order
+static void anchored_partition(const fm_index *fmi, const unsigned char *seq, struct anchored *a, dp_workspace *ws) {
+  seed seeds[MAX_SEEDS];
+  hit hits[MAX_HITS];
+  chain all[MAX_HITS];
+  const int k = a->k, olen = a->olen;
+  int n = partition_seeds(fmi, a->pattern, olen, k, a->maxocc, seeds);
+  n = locate_seeds(fmi, seeds, n, hits, MAX_HITS);
+  n = chain_hits(hits, n, k, 0, all, MAX_HITS, a->chits);
+  a->nchains = 0;
+  a->curchain = 0;
+  for (int c = 0; c < n; ++c) {
+    // The first hit matched exactly, so it can be lined up against the
+    // genome as it is
+    const hit *h = &a->chits[all[c].first];
+    long long before = h->start + k, after = olen - h->start + k;
+    if (before > h->pos)
+      before = h->pos;
+    if (after > fmi->len - h->pos)
+      after = fmi->len - h->pos;
+    int score = k + 1 - split_distance_within(ws, a->pattern, olen, h->start, seq, h->pos, before, after, k);
+    if (score <= 0 || (a->nchains == MAX_CHAINS && score <= a->chains[MAX_CHAINS-1].score))
+      continue;
+    int i = (a->nchains < MAX_CHAINS) ? a->nchains++ : MAX_CHAINS - 1;
+    for (; i > 0 && a->chains[i-1].score < score; --i)
+      a->chains[i] = a->chains[i-1];
+    a->chains[i] = all[c];
+    a->chains[i].score = score;
   }
-  int best_align = 0;
-  int best_pos = -1;
-  for (long long int i = *sp; i < *ep; ++i) {
-    // Reads the start and end from sp and ep instead of using the last
-    // character of the sequence. It assumes that we have a mismatch at that
-    // point (mms returns if that happens or it finished)
-    // and tries the following things to try aligning it
-    
-    // 1) Assume that there was a substitution at that point. Use LF() to skip
-    // to the next nt and decrement len, then try aligning
-    {
-      int loc = unc_sa(fmi, i);
-      char sub_c = getbase(seq, loc-1);
-      int sub_idx = fmi->C[(ptrdiff_t)sub_c] + rank(fmi, sub_c, i), ins_idx = sub_idx;
-      int sub_end = sub_idx + 1, sub_align;
-      sub_align = mms_continue(fmi, pattern, len-1, &sub_idx, &sub_end) + 1;
-      best_align = sub_align;
-      best_pos = sub_idx;
-      if (sub_align > 6 || sub_align == len) {
-	*genomeskips = 0;
-	break;
-      }
+}
+
+// Finds the chains of seeds for the read (see chain_hits), which are then
+// aligned one by one from the CHAIN step
+static void anchored_chains(const fm_index *fmi, struct anchored *a) {
+  seed seeds[MAX_SEEDS];
+  hit hits[MAX_HITS];
+  // If the anchor was the first thing SEED found, it's also the first seed,
+  // so there's no need to find it again (unless it matches more than one
+  // place, when it's simplest to)
+  int end = (a->curpos >= 0 && a->len + a->anchlen == a->olen) ? a->len - 1 : a->olen;
+  int n = find_seeds(fmi, a->pattern, end, a->anchor_len, a->maxocc, seeds, MAX_SEEDS);
+  n = locate_seeds(fmi, seeds, n, hits, MAX_HITS);
+  if (end < a->olen && n < MAX_HITS) {
+    hits[n].start = a->len;
+    hits[n].end = a->olen;
+    hits[n].pos = a->curpos;
+    n++;
+  }
+  a->nchains = chain_hits(hits, n, a->indels, a->maxintron, a->chains, MAX_CHAINS, a->chits);
+  a->curchain = 0;
+}
 
-      // 1.5) Assume that there was an insertion (on the genome) at that point of up to three nts
-      // Use LF() to skip one, two, and three nts and _don't_ decrement len, then try aligning for each of those
-      int bleh = ins_idx;
+// The read before its first hit h (or after its last one, for the tail) as
+// an exon of its own, up to maxintron bases further up (or down) the genome,
+// spliced onto the hit; see splice_fast. Only tried if it doesn't line up
+// where it is. The base next to the hit is left out of the search, since
+// it's usually what the hit stopped at, which isn't necessarily part of the
+// exon searched for. Returns whether it was; the head's start in the
+// genome is then in a->pos. The tail goes on the stack before h, so h is
+// cut short by however much of it went into the splice; the head goes
+// after, so h's M (on top of the stack) is.
+static int anchored_splice_head(const unsigned char *seq, struct anchored *a, const hit *h) {
+  const int n = h->start, maxmis = SPLICE_MAXMIS(n - 1);
+  long long lo = h->pos - n - a->maxintron, hi = h->pos - n, x;
+  if (!a->maxintron || n <= SPLICE_MIN || n > SPLICE_MAX * a->anchor_len || (hi >= 0 && exon_search(a->pattern, n - 1, seq, hi, hi, maxmis + SPLICE_MARGIN - 1, 0) >= 0))
+    return 0;
+  hi -= MAX_INDELS + 1;
+  if (lo < 0)
+    lo = 0;
+  if (hi < lo || (x = exon_search(a->pattern, n - 1, seq, lo, hi, maxmis, 1)) < 0)
+    return 0;
+  stack *s = a->s;
+  int into = h->end - h->start - 1;
+  if (into > SPLICE_SLACK)
+    into = SPLICE_SLACK;
+  s->counts[s->size-1] -= into;
+  if (!splice_fast(a->pattern, n + into, seq, x, h->pos + into, s, &a->score)) {
+    s->counts[s->size-1] += into;
+    return 0;
+  }
+  a->pos = x;
+  return 1;
+}
 
-      int ins_end = ins_idx + 1, ins_align;
-      ins_align = mms_continue(fmi, pattern, len, &ins_idx, &ins_end);
-      if (ins_align > 5 || ins_align == len) {
-	best_align = sub_align;
-	best_pos = sub_idx;
-	*genomeskips = 1;
-	break;
-      }
+static int anchored_splice_tail(const fm_index *fmi, const unsigned char *seq, struct anchored *a, hit *h) {
+  const int n = a->olen - h->end, maxmis = SPLICE_MAXMIS(n - 1);
+  const unsigned char *tail = a->pattern + h->end;
+  long long end = h->pos + (h->end - h->start), lo = end + MAX_INDELS + 1, hi = end + a->maxintron, y;
+  if (!a->maxintron || n <= SPLICE_MIN || n > SPLICE_MAX * a->anchor_len || (end + n <= fmi->len && exon_search(tail + 1, n - 1, seq, end + 1, end + 1, maxmis + SPLICE_MARGIN - 1, 0) >= 0))
+    return 0;
+  if (hi > fmi->len - n)
+    hi = fmi->len - n;
+  if (hi < lo || (y = exon_search(tail + 1, n - 1, seq, lo + 1, hi + 1, maxmis, 0) - 1) < 0)
+    return 0;
+  int into = h->end - h->start - 1;
+  if (into > SPLICE_SLACK)
+    into = SPLICE_SLACK;
+  if (!splice_fast(tail - into, n + into, seq, end - into, y + n, a->s, &a->score))
+    return 0;
+  h->end -= into;
+  return 1;
+}
 
-      // two!
-      sub_c = getbase(seq, loc-2);
-      ins_idx = fmi->C[(ptrdiff_t)sub_c] + rank(fmi, sub_c, bleh);
-      int blah = ins_idx;
-      ins_align = mms_continue(fmi, pattern, len, &ins_idx, &ins_end);
-      if (ins_align > 5 || ins_align == len) {
-	best_align = sub_align;
-	best_pos = sub_idx;
-	*genomeskips = 2;
-	break;
-      }
+// The MAPQ of an alignment built around the current chain, from how much
+// better a chain it was than the next best (the ones before it having
+// failed): 0 if they were as good, up to 60 if there was no other
+static int anchored_mapq(const struct anchored *a) {
+  int best = a->chains[a->curchain].score;
+  int next = (a->curchain + 1 < a->nchains) ? a->chains[a->curchain + 1].score : 0;
+  if (best <= 0 || next >= best)
+    return 0;
+  return 60 * (best - next) / best;
+}
 
-      // three!
-      sub_c = getbase(seq, loc-3);
-      ins_idx = fmi->C[(ptrdiff_t)sub_c] + rank(fmi, sub_c, blah);
-      ins_align = mms_continue(fmi, pattern, len, &ins_idx, &ins_end);
-      if (ins_align > 5 || ins_align == len) {
-	best_align = sub_align;
-	best_pos = sub_idx;
-	*genomeskips = 3;
+// Carries on with the alignment until it needs the queued DP to be done
+// (returning 1) or it is finished (returning 0, with the result in a->pos)
+static int anchored_step(const fm_index *fmi, const unsigned char *seq, struct anchored *a, dp_workspace *ws) {
+  const unsigned char *pattern = a->pattern;
+  const int olen = a->olen, anchor_len = a->anchor_len;
+  stack *s = a->s;
+  for (;;) {
+    switch (a->step) {
+    case SEED:
+      if (a->k) {
+	// Pigeonhole seeding doesn't need an anchor
+	a->step = CHAIN;
 	break;
       }
-    }
-    
-    // 2) Assume that there was a deletion (on the genome) at that point.
-    // Ignore up to three nts and start aligning again
-    {
-      // This one is a lot simpler because we don't actually need to
-      // figure out the character
-      int del_idx = i, del_end = del_idx + 1, del_align;
-      del_align = mms_continue(fmi, pattern, len-1, &del_idx, &del_end) + 1;
-      if (del_align > 6 || del_align == len) {
-	best_align = del_align;
-	best_pos = del_idx;
-	*genomeskips = -1;
+      if (!((a->len > anchor_len) && ((olen - a->len) < 2 * anchor_len))) {
+	a->step = END;
 	break;
       }
+      a->score = -1;
+      while ((a->len > anchor_len) && ((olen - a->len) < 2 * anchor_len)) {
+	long long sp, ep, occ;
+	int seglen;
+	if (a->seeded) {
+	  seglen = a->seedlen;
+	  occ = a->seedocc;
+	  a->seeded = 0;
+	}
+	else {
+	  seglen = mms_seq(fmi, seq, pattern, a->len, anchor_len, &sp, &ep, &a->curpos);
+	  occ = ep - sp;
+	}
+	// An anchor that matches a few places is still worth chaining from;
+	// they're told apart by the rest of the read
+	if (seglen < anchor_len || (a->curpos < 0 && occ > a->maxocc)) {
+	  a->len -= 3;
+	  continue;
+	}
+	a->len -= seglen;
+	a->anchlen = seglen;
+	a->score = (int) (0.6 * (1 + olen));
+	a->indels = MAX_INDELS;
+
+	// Plenty of reads line up with the genome around the anchor with
+	// hardly any mismatches and no gaps, which is far cheaper to check
+	// than to find with the DP
+	long long start = a->curpos - a->len;
+	if (a->curpos >= 0 && start >= 0 && start + olen <= fmi->len) {
+	  s->size = 0;
+	  if (ungapped_fast(pattern, olen, seq, start, s, &a->score, a->xdrop)) {
+	    a->pos = start;
+	    a->mapq = 60;
+	    a->step = DONE;
+	    break;
+	  }
+	}
 
-      del_idx = i;
-      del_end = del_idx + 1;
-      del_align = mms_continue(fmi, pattern, len-2, &del_idx, &del_end) + 2;
-      if (del_align > 7 || del_align == len) {
-	best_align = del_align;
-	best_pos = del_idx;
-	*genomeskips = -2;
+	// Otherwise the rest is built around the chains of seeds
+	a->step = CHAIN;
 	break;
       }
+      break;
 
-      del_idx = i;
-      del_end = del_idx + 1;
-      del_align = mms_continue(fmi, pattern, len-3, &del_idx, &del_end) + 3;
-      if (del_align > 8 || del_align == len) {
-	best_align = del_align;
-	best_pos = del_idx;
-	*genomeskips = -3;
+    case CHAIN:
+      if (a->nchains >= 0)
+	;
+      else if (a->k)
+	anchored_partition(fmi, seq, a, ws);
+      else
+	anchored_chains(fmi, a);
+      if (a->curchain >= a->nchains) {
+	a->pos = -1;
+	a->step = DONE;
 	break;
       }
-    }
-  }
-  *sp = best_pos;
-  *ep = best_pos + 1;
-  return best_align;
-}
-
-// Pass in the required anchor length. No mismatch will be allowed.
-unsigned long long align_read_anchored(const fm_index *fmi, const unsigned char *seq, const unsigned char *pattern, int len, int anchor_len, stack *s) {
-  int score;
-  int indels;
-  const int olen = len;
-  long long curgap = 0;
-  long long curpos = -1;
-  long long endpos;
-  int anchlen;
-  while ((len > anchor_len) && ((olen - len) < 2 * anchor_len)) {
-    score = -1;
-    while ((len > anchor_len)  && ((olen - len) < 2 * anchor_len)) {
-      int seglen = mms(fmi, pattern, len, &curpos, &endpos);
-      if (seglen < anchor_len || endpos - curpos > 1) {
-	len -= 3;
-	continue;
+      {
+	// Starting again from the last hit, N-W aligns the tail of the read
+	const chain *c = &a->chains[a->curchain];
+	hit *h = &a->chits[c->first + c->n - 1];
+	long long end = h->pos + (h->end - h->start);
+	s->size = 0;
+	a->score = (int) (0.6 * (1 + olen));
+	a->indels = (a->k > MAX_INDELS) ? a->k : MAX_INDELS;
+	a->curhit = c->n - 1;
+	if (anchored_splice_tail(fmi, seq, a, h)) {
+	  a->step = CHAIN_TAIL;
+	  break;
+	}
+	int buflen = a->indels + (olen - h->end);
+	if (buflen + end > fmi->len)
+	  buflen = fmi->len - end;
+	a->step = CHAIN_TAIL;
+	if (anchored_nw(a, ws, pattern + h->end, olen - h->end, seq, end, buflen, 0))
+	  return 1;
       }
-      else {
-	len -= seglen;
-	anchlen = seglen;
-	score = (int) (0.6 * (1 + olen));
-	indels = 5; // Should be adjustable?
-	curpos = unc_sa(fmi, curpos);
-	//fprintf(stderr, "%d %d %d\n", anchlen, olen, len);
-
-	// And use N-W to align the "tail" of the read
-	int buflen = indels + (olen - (len + seglen));
-	if (buflen + curpos + seglen > fmi->len)
-	  buflen = fmi->len - curpos - seglen;
-	unsigned char *buf = malloc(buflen);
-	for (int i = 0; i < buflen; ++i)
-	  buf[i] = getbase(seq, curpos + seglen + i);
-	nw_fast(pattern + len + seglen, olen - (len + seglen),
-		buf, buflen, s, &score, &indels);
-	// TODO: it is probably better to instead reverse the tail of
-	// the buffer and align it from there
-
-	// We can ignore the return value (we don't really care where the
-	// end of the read ends up; we can calculate that from the CIGAR)
-	free(buf);
-	// Then push this anchor onto it
-	stack_push(s, 'M', seglen);
-	break;
+      break;
+
+    case CHAIN_TAIL:
+    case CHAIN_GAP:
+      {
+	// Then the hit itself, and S-W on the gap back to the one before it
+	// (hits never overlap on either side, but the gap may be empty on one
+	// of them)
+	hit *h = &a->chits[a->chains[a->curchain].first + a->curhit];
+	stack_push(s, 'M', h->end - h->start);
+	if ((a->score < 0) || (a->indels < 0)) {
+	  a->curchain++;
+	  a->step = CHAIN;
+	  break;
+	}
+	if (!a->curhit) {
+	  a->len = h->start;
+	  a->curpos = h->pos;
+	  a->step = HEAD;
+	  break;
+	}
+	hit *l = h - 1;
+	long long lend = l->pos + (l->end - l->start);
+	int rgap = h->start - l->end, ggap = h->pos - lend;
+	a->curhit--;
+	a->step = CHAIN_GAP;
+	if (a->maxintron && ggap - rgap > MAX_INDELS) {
+	  // Too far apart for a gap, so an intron. Either hit may have run on
+	  // into it by chance, so the splice is looked for from a little way
+	  // inside each (taking that back off l, and off h's M on the stack)
+	  int into_l = l->end - l->start - 1, into_h = h->end - h->start - 1;
+	  if (into_l > SPLICE_SLACK)
+	    into_l = SPLICE_SLACK;
+	  if (into_h > SPLICE_SLACK)
+	    into_h = SPLICE_SLACK;
+	  s->counts[s->size-1] -= into_h;
+	  l->end -= into_l;
+	  lend -= into_l;
+	  if (!splice_fast(pattern + l->end, h->start + into_h - l->end, seq, lend, h->pos + into_h, s, &a->score))
+	    a->score = -1;
+	}
+	else if (rgap && ggap) {
+	  if (anchored_sw(a, ws, pattern + l->end, rgap, seq, lend, ggap))
+	    return 1;
+	}
+	else if (rgap) {
+	  stack_push(s, 'I', rgap);
+	  a->indels -= rgap;
+	}
+	else if (ggap) {
+	  stack_push(s, 'D', ggap);
+	  a->indels -= ggap;
+	}
       }
-    }
-    
-    if (score < 0)
-      continue;
+      break;
 
-    // In the second loop we try to extend our anchor backwards
-    while ((len > anchor_len) && (score >= 0) && (indels >= 0)) {
-      for (curgap = 1; curgap + anchor_len < len && curgap < anchor_len && curgap < len; ++curgap) {
-	long long int start, end;
-	int seglen = mms(fmi, pattern, len-curgap, &start, &end);
-	if (seglen < anchor_len)
-	  continue;
-	int matched = 0;
-	for (long long i = start; i < end; ++i) {
-	  long long cpos = unc_sa(fmi, i);
-	  if (abs(cpos + seglen - curpos) - curgap <= 3) {
-	    matched = 1;
-	    // Align the stuff in between. In this case we don't need to
-	    // copy pattern to a new buffer, but we do still need to copy
-	    // the genome
-	    int buflen = curpos - (cpos + seglen);
-	    // There's a semi-theoretical problem that this might actually
-	    // be negative, but that's easy to resolve
-	    if (buflen < 0) {
-	      stack_push(s, 'I', -buflen);
-	      indels += buflen;
-	    }
-	    else {
-	      unsigned char *buf = malloc(buflen);
-	      for (int j = 0; j < buflen; ++j)
-		buf[j] = getbase(seq, cpos + seglen + j);
-	      // And compare
-	      sw_fast(pattern + (len - curgap), curgap, buf, buflen, s, &score, &indels);
-	      free(buf);
-	    }
-	    stack_push(s, 'M', seglen);
-	    curpos = cpos;
-	    len -= seglen + curgap;
-	    curgap = 0;
-	    break;
-	  }
+    case HEAD:
+      if ((a->score >= 0) && (a->indels >= 0)) {
+	if (a->len < 0) {
+	  // I don't even know when this happens
+	  a->pos = -1;
+	  a->step = DONE;
+	  break;
 	}
-	if (matched)
+	if (anchored_splice_head(seq, a, &a->chits[a->chains[a->curchain].first])) {
+	  a->mapq = anchored_mapq(a);
+	  a->step = DONE;
 	  break;
-	else
-	  continue;
+	}
+	a->step = HEAD_DONE;
+	if (anchored_head(a, seq, ws))
+	  return 1;
+	break;
       }
-      if (curgap) {
+      a->curchain++;
+      a->step = CHAIN;
+      break;
+
+    case HEAD_DONE:
+      if ((a->score >= 0) && (a->indels >= 0)) {
+	a->pos = a->curpos - 1 - a->ret;
+	a->mapq = anchored_mapq(a);
+	a->step = DONE;
 	break;
       }
-    }
-    if ((score >= 0) && (indels >= 0)) {
-      if (len < 0) {
-	// I don't even know when this happens
-	return 0;
+      a->curchain++;
+      a->step = CHAIN;
+      break;
+
+    case END:
+      if ((a->score < 0) || (a->indels < 0)) {
+	a->pos = -1;
+	a->step = DONE;
+	break;
       }
-      // Set up matrix for N-W alignment
-      int buflen = len + indels;
-      if (buflen > curpos)
-	buflen = curpos;
-      unsigned char *buf = malloc(buflen);
-      for (int i = 0; i < buflen; ++i)
-	buf[i] = getbase(seq, curpos - 1 - i);
-      unsigned char *buf2 = malloc(len);
-      for (int i = 0; i < len; ++i)
-	buf2[i] = pattern[len-1-i];
-      int x = nw_fast(buf2, len, buf, buflen, s, &score, &indels);
-      free(buf);
-      free(buf2);
-      //printf("%d %d\t", x, len);
-      printf("\t%d\n", indels);
-      if ((score >= 0) && (indels >= 0))
-	return curpos - x;
-      //return 0; // Give up early to save some time
+      a->step = END_DONE;
+      if (anchored_head(a, seq, ws))
+	return 1;
+      break;
+
+    case END_DONE:
+      a->pos = ((a->score >= 0) && (a->indels >= 0)) ? a->curpos - 1 - a->ret : -1;
+      a->step = DONE;
+      break;
+
+    default: // DONE
+      return 0;
     }
-    // reset the stack
-    len-= anchlen;
-    s->size = 0;
-  }
-  if ((score < 0) || (indels < 0)) {
-    return 0;
   }
+}
 
-  int buflen = len + indels;
-  if (buflen > curpos)
-    buflen = curpos;
-  unsigned char *buf = malloc(buflen);
-  for (int i = 0; i < buflen; ++i)
-    buf[i] = getbase(seq, curpos - 1 - i);
-  unsigned char *buf2 = malloc(len);
-  for (int i = 0; i < len; ++i)
-    buf2[i] = pattern[len-1-i];
-  int x = nw_fast(buf2, len, buf, buflen, s, &score, &indels);
-  free(buf);
-  free(buf2);
-  if ((score >= 0) && (indels >= 0))
-    return curpos - x;
-  return 0;
+// Pass in the required anchor length. No mismatch will be allowed.
+// xdrop (0 for none) is passed through to the DP; see nw_fast. Returns
+// where the read starts in the genome, or -1 if it didn't align.
+long long align_read_anchored(const fm_index *fmi, const unsigned char *seq, const unsigned char *pattern, int len, int anchor_len, int xdrop, dp_workspace *ws, stack *s) {
+  struct anchored a;
+  anchored_start(&a, pattern, len, anchor_len, xdrop, DEFAULT_MAXOCC, 0, 0, 0, s);
+  anchored_step(fmi, seq, &a, ws);
+  return a.pos;
 }
 
 int align_read(const fm_index *fmi, const unsigned char *seq, const unsigned char *pattern, int len, int thresh) {
-  int starts[10], lens[10], nsegments;
+  long long starts[10];
+  int lens[10] = { 0 }, nsegments;
   int penalty;
   int nmisses = len/10;
   int olen = len;
@@ -314,7 +521,7 @@ int align_read(const fm_index *fmi, const unsigned char *seq, const unsigned cha
     long long int start, end;
     int seglen = mms(fmi, pattern, len, &start, &end);
     if (seglen < thresh) {
-      int mlen = mms_mismatch(fmi, seq, pattern, len - seglen, &start, &end, &penalty);
+      int mlen = mms_mismatch(fmi, seq, pattern, len - seglen, &start, &end, DEFAULT_MAXOCC, &penalty);
       if (mlen + seglen > 2 * thresh) {
 	len -= seglen + mlen + 3;
 	starts[nsegments] = start;
@@ -338,7 +545,7 @@ int align_read(const fm_index *fmi, const unsigned char *seq, const unsigned cha
       continue;
     }
     // Otherwise try continuing the search
-    int mlen = mms_mismatch(fmi, seq, pattern, len - seglen, &start, &end, &penalty);
+    int mlen = mms_mismatch(fmi, seq, pattern, len - seglen, &start, &end, DEFAULT_MAXOCC, &penalty);
     len -= seglen + mlen + 3;
     starts[nsegments] = start;
     lens[nsegments] = seglen + mlen;
@@ -350,7 +557,7 @@ int align_read(const fm_index *fmi, const unsigned char *seq, const unsigned cha
     // For each segment check whether it's within 6 nts of the next
     
     for (int i = 0; i < nsegments - 1; ++i) {
-      if (abs(unc_sa(fmi, starts[i+1]) + lens[i+1] - unc_sa(fmi, starts[i])) < 7) {
+      if (llabs(unc_sa(fmi, starts[i+1]) + lens[i+1] - unc_sa(fmi, starts[i])) < 7) {
 	totlen += lens[i+1];
 	continue;
       } 
@@ -363,24 +570,513 @@ int align_read(const fm_index *fmi, const unsigned char *seq, const unsigned cha
   return 0;
 }
 
-// Reminder to self: buf length (i.e. maximum read length) is currently
-// hardcoded; change to a larger value (to align longer reads) or make it
-// dynamic
+// Names the reference after its file, without the directory or extension
+static char *ref_name(const char *path) {
+  const char *base = strrchr(path, '/');
+  char *name = strdup(base ? base + 1 : path), *ext = strrchr(name, '.');
+  if (ext && ext != name)
+    *ext = 0;
+  return name;
+}
+
+// The insert sizes of a paired library, learnt as the reads go: the mean
+// and spread (by Welford's method) of the fragments of all the pairs so far
+// whose reads face each other and were both placed confidently
+struct insert_model {
+  pthread_mutex_t lock;
+  long long n;
+  double mean, m2;
+};
+
+struct thread_args {
+  const fm_index *fmi;
+  const unsigned char *seq;
+  read_input *ri, *mri;   // mri is the mates' file, for pairs
+  pthread_mutex_t *rlock; // Protects ri and mri
+  sam_writer *w;
+  struct insert_model *model;
+  int minqual;
+  int xdrop;
+  long long maxocc;
+  int k, maxintron;
+  int both;       // Whether to align both strands at once (see align_inflight)
+  int naligned;
+  int nread;
+};
+
+// How many reads each worker has on the go at once, so that there is
+// plenty of DP to queue up
+#define INFLIGHT 256
+
+struct inflight {
+  read_rec r;
+  unsigned char *buf, *revbuf;
+  int bufcap;
+  int rev;         // Whether we're on the reverse complement yet
+  struct anchored a[2]; // Forward and reverse complement
+  stack *s, *rs;   // rs is the reverse complement's, when they're aligned
+                   // at once; it ends up in s if that one wins
+};
+
+// With both strands aligned at once, the one whose alignment cost least
+// wins (the forward one on a tie, with a MAPQ of 0, since the read then
+// lines up as well either way round); its CIGAR is left in f->s
+static void inflight_choose(struct inflight *f) {
+  struct anchored *a = f->a;
+  if (a[0].pos >= 0 && a[1].pos >= 0) {
+    f->rev = a[1].score > a[0].score;
+    if (a[1].score == a[0].score)
+      a[0].mapq = 0;
+  }
+  else
+    f->rev = a[0].pos < 0 && a[1].pos >= 0;
+  if (a[f->rev].s != f->s) {
+    stack *t = f->s;
+    f->s = f->rs;
+    f->rs = t;
+  }
+}
+
+// Gets a read ready to be aligned, trying it for an exact match first
+static void inflight_start(struct inflight *f, const struct thread_args *ta) {
+  int len = f->r.len;
+  if (len > f->bufcap) {
+    f->bufcap = 2 * len;
+    free(f->buf);
+    free(f->revbuf);
+    f->buf = malloc(f->bufcap);
+    f->revbuf = malloc(f->bufcap);
+  }
+  // Replace with "compressed" characters
+  encode_read(&f->r, f->buf, f->revbuf, ta->minqual);
+  f->rev = 0;
+  f->s->size = 0;
+  f->rs->size = 0;
+  // Exact hits on either strand go straight out; only the rest need
+  // the gapped alignment, which starts on the forward strand (or on both)
+  anchored_start(&f->a[0], f->buf, len, 12, ta->xdrop, ta->maxocc, ta->k, ta->maxintron, 1, f->s);
+  anchored_start(&f->a[1], f->revbuf, len, 12, ta->xdrop, ta->maxocc, ta->k, ta->maxintron, 1, ta->both ? f->rs : f->s);
+  if (!anchored_exact(ta->fmi, ta->seq, &f->a[0]) && anchored_exact(ta->fmi, ta->seq, &f->a[1]))
+    f->rev = 1;
+  if (ta->both && f->a[f->rev].step == DONE) {
+    // Nothing on the other strand could do better
+    f->a[!f->rev].pos = -1;
+    f->a[!f->rev].step = DONE;
+    inflight_choose(f);
+  }
+}
+
+// Takes every read as far as it will go, then does all the DP that they're
+// waiting on together, until they're all done. Usually the reverse
+// complement is only tried once the read doesn't align forwards, so a read
+// that doesn't align (or only the other way round) takes both in turn;
+// with both set, the two strands are taken along side by side instead, so
+// that their DP goes into the same flushes, and the better of their
+// alignments is chosen rather than just the first.
+static void align_inflight(const fm_index *fmi, const unsigned char *seq, dp_workspace *ws, struct inflight **todo, int n, int both) {
+  int i, busy;
+  do {
+    busy = 0;
+    for (i = 0; i < n; ++i) {
+      struct inflight *f = todo[i];
+      if (both) {
+	anchored_step(fmi, seq, &f->a[0], ws);
+	anchored_step(fmi, seq, &f->a[1], ws);
+	if (f->a[0].step != DONE || f->a[1].step != DONE)
+	  busy = 1;
+	continue;
+      }
+      while (!anchored_step(fmi, seq, &f->a[f->rev], ws)) {
+	if (f->a[f->rev].pos >= 0 || f->rev)
+	  break;
+	// Try the reverse complement instead
+	f->rev = 1;
+	f->s->size = 0;
+      }
+      if (f->a[f->rev].step != DONE)
+	busy = 1;
+    }
+    dp_flush(ws);
+  } while (busy);
+  if (both)
+    for (i = 0; i < n; ++i)
+      inflight_choose(todo[i]);
+}
+
+void *align_worker(void *arg) {
+  struct thread_args *ta = arg;
+  const fm_index *fmi = ta->fmi;
+  const unsigned char *seq = ta->seq;
+  struct inflight *fl = calloc(INFLIGHT, sizeof(struct inflight));
+  struct inflight *todo[INFLIGHT];
+  sam_buf *out = sam_buf_make(ta->w);
+  dp_workspace *ws = dp_workspace_make();
+  read_chunk chunk;
+  int i;
+  for (i = 0; i < INFLIGHT; ++i) {
+    fl[i].s = stack_make();
+    fl[i].rs = stack_make();
+  }
+  ta->naligned = 0;
+  ta->nread = 0;
+  for (;;) {
+    pthread_mutex_lock(ta->rlock);
+    int more = ri_chunk(ta->ri, &chunk);
+    pthread_mutex_unlock(ta->rlock);
+    if (!more)
+      break;
+    while (more) {
+      int n = 0;
+      while (n < INFLIGHT && (more = chunk_next(&chunk, &fl[n].r))) {
+	inflight_start(&fl[n], ta);
+	todo[n] = &fl[n];
+	n++;
+      }
+      ta->nread += n;
+      align_inflight(fmi, seq, ws, todo, n, ta->both);
+      for (i = 0; i < n; ++i) {
+	struct inflight *f = &fl[i];
+	if (f->a[f->rev].pos >= 0) {
+	  ta->naligned++;
+	  sam_record(out, &f->r, f->rev ? SAM_REVERSE : 0, f->a[f->rev].pos, f->a[f->rev].mapq, f->s);
+	}
+	else
+	  sam_record(out, &f->r, SAM_UNMAPPED, 0, 0, f->s);
+      }
+    }
+    chunk_release(&chunk);
+  }
+  for (i = 0; i < INFLIGHT; ++i) {
+    stack_destroy(fl[i].s);
+    stack_destroy(fl[i].rs);
+    free(fl[i].buf);
+    free(fl[i].revbuf);
+  }
+  free(fl);
+  dp_workspace_destroy(ws);
+  sam_buf_destroy(out);
+  return NULL;
+}
+
+// Pairs. The reads of a pair face each other (FR), from either end of a
+// fragment whose length is learnt as we go (see insert_model). One read of
+// each pair is aligned first, and where it's confidently placed (with a
+// MAPQ of at least RESCUE_MAPQ) its mate is looked for only in the window
+// the insert sizes allow (see search_fast), with no seeding at all; it's
+// only aligned the usual way if it isn't there. Until INSERT_MIN_PAIRS
+// pairs have been seen, both reads are aligned the usual way and anything
+// up to DEFAULT_MAX_INSERT long counts as a proper pair; after that the
+// inserts within INSERT_SDS standard deviations (at least INSERT_MIN_SD) of
+// the mean do.
+#define RESCUE_MAPQ 20
+#define INSERT_MIN_PAIRS 100
+#define DEFAULT_MAX_INSERT 1000
+#define INSERT_SDS 4
+#define INSERT_MIN_SD 10
+
+// The range of insert sizes that make a proper pair; returns whether it is
+// from the model yet
+static int insert_range(struct insert_model *m, long long *lo, long long *hi) {
+  pthread_mutex_lock(&m->lock);
+  long long n = m->n;
+  double mean = m->mean, sd = (n > 1) ? sqrt(m->m2 / (n - 1)) : 0;
+  pthread_mutex_unlock(&m->lock);
+  if (n < INSERT_MIN_PAIRS) {
+    *lo = 0;
+    *hi = DEFAULT_MAX_INSERT;
+    return 0;
+  }
+  if (sd < INSERT_MIN_SD)
+    sd = INSERT_MIN_SD;
+  *lo = (mean > INSERT_SDS * sd) ? (long long) (mean - INSERT_SDS * sd) : 0;
+  *hi = (long long) (mean + INSERT_SDS * sd + 0.5);
+  return 1;
+}
+
+// Adds a batch of insert sizes to the model, all at once (by Chan et al.'s
+// rule for combining means and variances)
+static void insert_add(struct insert_model *m, const long long *sizes, int n) {
+  double mean = 0, m2 = 0;
+  if (!n)
+    return;
+  for (int i = 0; i < n; ++i) {
+    double delta = sizes[i] - mean;
+    mean += delta / (i + 1);
+    m2 += delta * (sizes[i] - mean);
+  }
+  pthread_mutex_lock(&m->lock);
+  double delta = mean - m->mean;
+  long long total = m->n + n;
+  m->m2 += m2 + delta * delta * m->n * n / total;
+  m->mean += delta * n / total;
+  m->n = total;
+  pthread_mutex_unlock(&m->lock);
+}
+
+// How much of the genome an alignment covers, by its CIGAR
+static long long ref_span(const stack *s) {
+  long long span = 0;
+  for (int i = 0; i < s->size; ++i)
+    if (s->chars[i] == 'M' || s->chars[i] == 'D' || s->chars[i] == 'N')
+      span += s->counts[i];
+  return span;
+}
+
+// Which read of a pair to align first: one that matched exactly, or failing
+// that one whose first seed wasn't a repeat (with more matches than -c allows)
+static int pair_first(const struct inflight *f) {
+  for (int m = 0; m < 2; ++m)
+    if (f[m].a[f[m].rev].step == DONE)
+      return m;
+  const long long maxocc = f[0].a[0].maxocc;
+  return f[0].a[0].seedocc > maxocc && f[1].a[0].seedocc <= maxocc;
+}
+
+// Looks for b where the mate of a (which has been placed) should be, given
+// the range of insert sizes: on the other strand, facing a. Returns whether
+// it was found; it is then done, as if it had been aligned.
+static int pair_rescue(const fm_index *fmi, const unsigned char *seq, dp_workspace *ws, const struct inflight *a, struct inflight *b, long long lo, long long hi) {
+  const struct anchored *x = &a->a[a->rev];
+  const int len = b->r.len, rev = !a->rev;
+  struct anchored *y = &b->a[rev];
+  long long wlo, whi, pos;
+  if (!a->rev) {
+    wlo = x->pos + lo - len - MAX_INDELS;
+    whi = x->pos + hi + MAX_INDELS;
+  }
+  else {
+    long long end = x->pos + ref_span(a->s);
+    wlo = end - hi - MAX_INDELS;
+    whi = end - lo + len + MAX_INDELS;
+  }
+  if (wlo < 0)
+    wlo = 0;
+  if (whi > fmi->len)
+    whi = fmi->len;
+  if (whi - wlo < len)
+    return 0;
+  int score = (int) (0.6 * (1 + len)), indels = MAX_INDELS;
+  b->s->size = 0;
+  if (!search_fast(ws, rev ? b->revbuf : b->buf, len, seq, wlo, whi - wlo, b->s, &score, &indels, &pos)) {
+    b->s->size = 0;
+    return 0;
+  }
+  b->rev = rev;
+  y->pos = pos;
+  y->mapq = x->mapq;
+  y->step = DONE;
+  return 1;
+}
+
+// Writes out a pair, once both its reads are done; returns whether it's
+// one to learn the insert size from (which is then in *size)
+static int pair_output(sam_buf *out, const struct inflight *f, long long lo, long long hi, int *naligned, long long *size) {
+  long long pos[2], end[2], tlen[2] = { 0, 0 };
+  int flag[2], mapq[2], m, proper = 0;
+  for (m = 0; m < 2; ++m) {
+    const struct anchored *a = &f[m].a[f[m].rev];
+    pos[m] = a->pos;
+    end[m] = a->pos + ref_span(f[m].s);
+    mapq[m] = a->mapq;
+    flag[m] = SAM_PAIRED | (m ? SAM_READ2 : SAM_READ1);
+    if (pos[m] < 0)
+      flag[m] |= SAM_UNMAPPED;
+    else {
+      (*naligned)++;
+      if (f[m].rev)
+	flag[m] |= SAM_REVERSE;
+    }
+  }
+  for (m = 0; m < 2; ++m) {
+    if (flag[!m] & SAM_UNMAPPED)
+      flag[m] |= SAM_MATE_UNMAPPED;
+    if (flag[!m] & SAM_REVERSE)
+      flag[m] |= SAM_MATE_REVERSE;
+  }
+  if (pos[0] >= 0 && pos[1] >= 0) {
+    // The fragment runs from the leftmost start to the rightmost end; it's
+    // positive for the read it starts with
+    long long left = (pos[0] < pos[1]) ? pos[0] : pos[1];
+    long long right = (end[0] > end[1]) ? end[0] : end[1];
+    int first = (pos[1] < pos[0]);
+    tlen[first] = right - left;
+    tlen[!first] = left - right;
+    // Proper if they face each other, the forward one first
+    if (f[0].rev != f[1].rev) {
+      const int fwd = f[1].rev ? 0 : 1;
+      if (pos[fwd] <= end[!fwd] && right - left >= lo && right - left <= hi) {
+	proper = 1;
+	flag[0] |= SAM_PROPER_PAIR;
+	flag[1] |= SAM_PROPER_PAIR;
+      }
+    }
+  }
+  for (m = 0; m < 2; ++m)
+    sam_pair_record(out, &f[m].r, flag[m], pos[m], (flag[m] & SAM_UNMAPPED) ? 0 : mapq[m], f[m].s, pos[!m], tlen[m]);
+  if (proper && mapq[0] >= RESCUE_MAPQ && mapq[1] >= RESCUE_MAPQ) {
+    *size = (tlen[0] > 0) ? tlen[0] : -tlen[0];
+    return 1;
+  }
+  return 0;
+}
+
+void *pair_worker(void *arg) {
+  struct thread_args *ta = arg;
+  const fm_index *fmi = ta->fmi;
+  const unsigned char *seq = ta->seq;
+  struct inflight *fl = calloc(INFLIGHT, sizeof(struct inflight));
+  struct inflight *todo[INFLIGHT / 2];
+  long long sizes[INFLIGHT / 2];
+  sam_buf *out = sam_buf_make(ta->w);
+  dp_workspace *ws = dp_workspace_make();
+  read_chunk chunk[2];
+  int i;
+  for (i = 0; i < INFLIGHT; ++i) {
+    fl[i].s = stack_make();
+    fl[i].rs = stack_make();
+  }
+  ta->naligned = 0;
+  ta->nread = 0;
+  for (;;) {
+    // The mates' chunk has however many reads the first one does
+    pthread_mutex_lock(ta->rlock);
+    int more = ri_chunk(ta->ri, &chunk[0]);
+    if (more && !ri_chunk_records(ta->mri, &chunk[1], chunk_records(&chunk[0]))) {
+      fprintf(stderr, "The second read file has fewer reads than the first\n");
+      chunk_release(&chunk[0]);
+      more = 0;
+    }
+    pthread_mutex_unlock(ta->rlock);
+    if (!more)
+      break;
+    while (more) {
+      int n = 0, first[INFLIGHT / 2], nt;
+      long long lo, hi;
+      while (2 * n < INFLIGHT) {
+	struct inflight *f = &fl[2*n];
+	more = chunk_next(&chunk[0], &f[0].r);
+	if (more != chunk_next(&chunk[1], &f[1].r)) {
+	  fprintf(stderr, "The read files have different numbers of reads\n");
+	  more = 0;
+	}
+	if (!more)
+	  break;
+	inflight_start(&f[0], ta);
+	inflight_start(&f[1], ta);
+	first[n++] = pair_first(f);
+      }
+      ta->nread += 2 * n;
+      const int ready = insert_range(ta->model, &lo, &hi);
+      for (i = 0; i < n; ++i)
+	todo[i] = &fl[2*i + first[i]];
+      align_inflight(fmi, seq, ws, todo, n, ta->both);
+      // Then their mates, rescued if they can be
+      for (i = nt = 0; i < n; ++i) {
+	struct inflight *a = &fl[2*i + first[i]], *b = &fl[2*i + !first[i]];
+	if (b->a[b->rev].step == DONE)
+	  continue;
+	if (!ready || a->a[a->rev].pos < 0 || a->a[a->rev].mapq < RESCUE_MAPQ ||
+	    !pair_rescue(fmi, seq, ws, a, b, lo, hi))
+	  todo[nt++] = b;
+      }
+      align_inflight(fmi, seq, ws, todo, nt, ta->both);
+      for (i = nt = 0; i < n; ++i)
+	nt += pair_output(out, &fl[2*i], lo, hi, &ta->naligned, &sizes[nt]);
+      insert_add(ta->model, sizes, nt);
+    }
+    chunk_release(&chunk[0]);
+    chunk_release(&chunk[1]);
+  }
+  for (i = 0; i < INFLIGHT; ++i) {
+    stack_destroy(fl[i].s);
+    stack_destroy(fl[i].rs);
+    free(fl[i].buf);
+    free(fl[i].revbuf);
+  }
+  free(fl);
+  dp_workspace_destroy(ws);
+  sam_buf_destroy(out);
+  return NULL;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-q minqual] [-t threads] [-z level] [-x xdrop] [-c maxocc] [-k edits] [-i maxintron] [-b] [-s [-m MB] [-T tmpdir]] seqfile indexfile readfile [matefile]\n", prog);
+  exit(-1);
+}
+
+// readfile may be "-" to read from stdin
 
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s seqfile indexfile readfile\n", argv[0]);
-    exit(-1);
+  int opt, minqual = 0, nthreads = 1, level = -2, xdrop = 0, k = 0, maxintron = 0, both = 0;
+  long long maxocc = DEFAULT_MAXOCC;
+  size_t sortmem = 0, mem = 768;
+  const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  while ((opt = getopt(argc, argv, "q:t:z:x:c:k:i:bsm:T:")) != -1) {
+    switch (opt) {
+    case 'q':
+      minqual = atoi(optarg);
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      if (nthreads < 1)
+	nthreads = 1;
+      break;
+    case 'z':
+      level = atoi(optarg);
+      break;
+    case 'x':
+      xdrop = atoi(optarg);
+      if (xdrop < 0)
+	xdrop = 0;
+      break;
+    case 'c':
+      maxocc = atoll(optarg);
+      if (maxocc < 1)
+	maxocc = 1;
+      break;
+    case 'k':
+      k = atoi(optarg);
+      if (k < 0)
+	k = 0;
+      if (k >= MAX_SEEDS)
+	k = MAX_SEEDS - 1;
+      break;
+    case 'i':
+      maxintron = atoi(optarg);
+      if (maxintron < 0)
+	maxintron = 0;
+      break;
+    case 'b':
+      both = 1;
+      break;
+    case 's':
+      sortmem = 1;
+      break;
+    case 'm':
+      mem = atoi(optarg);
+      break;
+    case 'T':
+      tmpdir = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
   }
-  char *seqfile, *indexfile, *readfile;
-  unsigned char *seq, *buf = malloc(256 * 256), *revbuf = malloc(256 * 256), c;
+  if (argc - optind != 3 && argc - optind != 4)
+    usage(argv[0]);
+  if (sortmem)
+    sortmem = mem << 20;
+  char *seqfile, *indexfile, *readfile, *rname;
+  unsigned char *seq, c;
   fm_index *fmi;
   int len;
   int i;
-  FILE *sfp, *ifp, *rfp;
-  seqfile = argv[1];
-  indexfile = argv[2];
-  readfile = argv[3];
+  FILE *sfp, *ifp;
+  read_input *ri, *mri = 0;
+  seqfile = argv[optind];
+  indexfile = argv[optind+1];
+  readfile = argv[optind+2];
+  rname = ref_name(seqfile);
   sfp = fopen(seqfile, "rb");
   if (sfp == 0) {
     fprintf(stderr, "Could not open sequence\n");
@@ -435,81 +1131,67 @@ int main(int argc, char **argv) {
   fmi = read_index(ifp);
   fclose(ifp);
 
-  // And now we go read the index file
-  rfp = fopen(readfile, "r");
-  if (rfp == 0) {
+  // And now we go read the reads
+  ri = ri_open(readfile);
+  if (ri == 0) {
     fprintf(stderr, "Could not open reads file");
     exit(-1);
   }
-  // Read one line ("read") and try aligning it
-  
+  if (argc - optind == 4 && !(mri = ri_open(argv[optind+3]))) {
+    fprintf(stderr, "Could not open mates file");
+    exit(-1);
+  }
+  // Each thread takes a chunk of reads at a time and aligns them
+  sam_writer *w;
+  if (level != -2)
+    w = sam_open_bgzf(1, rname, level, nthreads);
+  else
+    w = sam_open(1, rname);
+  if (sortmem)
+    sam_sort(w, sortmem, tmpdir);
+  sam_header(w, len, argc, argv);
+  pthread_mutex_t rlock;
+  pthread_mutex_init(&rlock, 0);
+  struct insert_model model = { .n = 0, .mean = 0, .m2 = 0 };
+  pthread_mutex_init(&model.lock, 0);
+  pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+  struct thread_args *ta = malloc(nthreads * sizeof(struct thread_args));
+  for (i = 0; i < nthreads; ++i) {
+    ta[i].fmi = fmi;
+    ta[i].seq = seq;
+    ta[i].ri = ri;
+    ta[i].mri = mri;
+    ta[i].rlock = &rlock;
+    ta[i].model = &model;
+    ta[i].w = w;
+    ta[i].minqual = minqual;
+    ta[i].xdrop = xdrop;
+    ta[i].maxocc = maxocc;
+    ta[i].k = k;
+    ta[i].maxintron = maxintron;
+    ta[i].both = both;
+    pthread_create(&threads[i], NULL, mri ? pair_worker : align_worker, &ta[i]);
+  }
   int naligned = 0;
   int nread = 0;
-  while (!feof(rfp)) {
-    if (!fgets((char *)buf, 256*256-1, rfp))
-      break;
-    nread++;
-    if (buf[strlen((char *)buf)-1] == '\n')
-      buf[strlen((char *)buf)-1] = 0;
-    int len = strlen((char *)buf);
-    for (int i = 0; i < len; ++i) {
-      // Replace with "compressed" characters
-      switch(buf[i]) {
-      case 'A':
-	buf[i] = 0;
-	revbuf[len-i-1] = 3;
-	break;
-      case 'C':
-	buf[i] = 1;
-	revbuf[len-i-1] = 2;
-	break;
-      case 'T':
-	buf[i] = 3;
-	revbuf[len-i-1] = 0;
-	break;
-      case 'G':
-	buf[i] = 2;
-	revbuf[len-i-1] = 1;
-	break;
-      default: // 'N'
-	buf[i] = 5;
-	revbuf[len-i-1] = 5;
-	break;
-      }
-    }
-
-    stack *s = stack_make();
-    //    int thresh = (int) (-1.2 * (1+len));
-
-    //    int pos = align_read(fmi, seq, buf, len, 10);
-    int pos = align_read_anchored(fmi, seq, buf, len, 12, s);
-    if (pos) {
-      naligned++;
-      printf("%d\n", pos + 1);
-      stack_print_destroy(s);
-    }
-    else {
-      stack_destroy(s);
-      s = stack_make();
-      //      pos = align_read(fmi, seq, revbuf, len, 10);
-      pos = align_read_anchored(fmi, seq, revbuf, len, 12, s);
-      if (pos) {
-	naligned++;
-	printf("%d\n", pos + 1);
-	stack_print_destroy(s);
-      }
-      else {
-	printf("0\n");
-	stack_destroy(s);
-      }
-    }
+  for (i = 0; i < nthreads; ++i) {
+    pthread_join(threads[i], NULL);
+    naligned += ta[i].naligned;
+    nread += ta[i].nread;
   }
-  fclose(rfp);
+  free(threads);
+  free(ta);
+  pthread_mutex_destroy(&rlock);
+  pthread_mutex_destroy(&model.lock);
+  ri_close(ri);
+  ri_close(mri);
+  sam_close(w);
   fprintf(stderr, "%d of %d reads aligned\n", naligned, nread);
+  if (mri && model.n > 1)
+    fprintf(stderr, "Insert size %.1f +- %.1f, from %lld pairs\n", model.mean, sqrt(model.m2 / (model.n - 1)), model.n);
   
-  free(buf);
-  free(revbuf);
   destroy_fmi(fmi);
   free(seq);
+  free(rname);
   return 0;
 }
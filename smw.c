@@ -1,186 +1,764 @@
-// Slowish implementation of Smith-Waterman algorithm for local alignments
-// There are optimizations involving SIMD instructions but they don't really
-// seem that worthwhile
+// Smith-Waterman and Needleman-Wunsch alignment of the bits of the read
+// between and around anchors, with affine gaps. The actual dynamic
+// programming is done with SSE4.1 or AVX2 (whichever the CPU has) along
+// anti-diagonals; see smw_kernel.h. Problems can also be queued up and
+// solved many at a time, one to each SIMD lane (see nw_queue).
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include "rdtscll.h"
 #include "stack.h"
+#include "smw.h"
+#include "packed.h"
 
 static inline int max(int a, int b, int c) {
   return (a > b) ? ((a > c) ? a : c) : ((b > c) ? b : c);
 }
 
-// Optimization of needleman-wunsch by using a 1d output array; is faster by a
-// pretty hilarious factor (>40x) due to the lack of another level of
-// indirection and/or cache optimizations and/or lack of malloc() calls
+#define NEG_INF (-16384)
 
-// str1 should be the read (allowed characters are 0-3 and 5), str2 the
-// genome (allowed characters 0-3), both unpacked form. 'N' on the read will
-// be treated as if it matches all characters.
+// Which kernels there is any point trying; smwtest defines this itself, to
+// try each of them in turn
+#ifndef CPU_SUPPORTS
+#define CPU_SUPPORTS(x) __builtin_cpu_supports(x)
+#endif
 
-// Returns the position on str2 that the last character of str1 was aligned
-// to. Outputs some CIGARs to the given stack. This function can be used
-// to align both the head and tail; the head should be passed in backwards
-// (i.e. str1[0] and str2[0] are the characters that the MMS failed on)
-int nw_fast(const unsigned char *str1, int len1, const unsigned char *str2, int len2, stack *s, int *score, int *indels) {
-  //  fprintf(stderr, "%d %d\n", len1, len2);
-  if (len1 == 0) { // happens more often than you'd think
-    return 0; // Nothing at all to do
-  }
-  int *values, i, j;
-  int mx = -1000000, maxloc = 0;
-  values = malloc((len1 + 1) * (len2 + 1) * sizeof(int));
-  char *pointers = malloc((len1 + 1) * (len2 + 1));
-  stack *flips = stack_make();
-  // "Zero" first row
-  values[0] = 0;
-  for (j = 1; j <= len2; ++j) {
-    pointers[j] = 2;
-    values[j] = -5-3*j;
+// What p->last holds for the cells that were never reached
+#define UNREACHED (INT_MIN / 2)
+
+// In X-drop mode, what each base of str1 left unaligned at the end costs.
+// Equivalently every base that is aligned earns this much, which is what
+// X-drop measures the drop in (matches themselves score nothing here, so
+// the plain score can only ever go down).
+#define CLIP_PENALTY 2
+
+// Trace bits for each cell: the low two bits say where H came from (0 for
+// a match/mismatch, 1 for a skip on str1 (F), 2 for a skip on str2 (E));
+// the others say whether E and F were extended rather than opened there.
+// That is four bits, so cells are packed two to a byte.
+#define TR_EEXT 4
+#define TR_FEXT 8
+
+// Only cells with |i - j| <= w are computed, since any path through
+// anything else has more than w gaps in it. Computation stops as soon as
+// nothing can end up scoring at least floor.
+
+// With xdrop set, the alignment may instead stop anywhere, at a cost of
+// CLIP_PENALTY for each base of str1 left over; (bi, bj) is the best place
+// to stop, and best its score plus CLIP_PENALTY * bi. Computation also
+// stops once everything on two consecutive anti-diagonals is more than
+// xdrop below that.
+
+// Cells are stored anti-diagonal by anti-diagonal (which is the order the
+// vector kernels produce them in); doff[d] is the byte where the band on
+// anti-diagonal d starts. Each anti-diagonal starts at an even i (see
+// trace_base) so that pairs of cells always share a byte.
+
+// Only the trace takes more than linear space; all the scores are kept a
+// row (or anti-diagonal) at a time. Everything lives in a dp_workspace,
+// which is only ever grown, so nothing is allocated once it is big enough.
+struct dp {
+  int n1, n2;
+  int w, floor;
+  int free_end;        // Whether the alignment may end anywhere on the last row
+  int xdrop;
+  int best, bi, bj;
+  int dmax;            // Last anti-diagonal that the band reaches
+  short *a, *b;        // a[i] = str1[i-1], b = str2 reversed
+  short *h[3], *e, *f[2];
+  unsigned char *trace;
+  int *doff;
+  int *last;           // H along the last row (i = n1)
+  // For a problem solved in a lane of dp_lanes, the trace is a short per
+  // cell instead, row by row (only the band, 2 * lw + 1 cells of each row)
+  // and interleaved with the other lanes; lanes is 0 otherwise
+  const short *ltrace;
+  int lanes, lw;
+};
+
+// Range of i within the band on anti-diagonal d
+static inline int band_lo(const struct dp *p, int d) {
+  int lo = (d - p->w + 1) / 2;
+  if (d - p->n2 > lo)
+    lo = d - p->n2;
+  return (lo > 0) ? lo : 0;
+}
+
+static inline int band_hi(const struct dp *p, int d) {
+  int hi = (d + p->w) / 2;
+  if (hi > d)
+    hi = d;
+  return (hi > p->n1) ? p->n1 : hi;
+}
+
+// The (even) i that the trace for anti-diagonal d is stored from; cell 0 is
+// never traced
+static inline int trace_base(const struct dp *p, int d) {
+  int lo = band_lo(p, d);
+  return ((lo > 1) ? lo : 1) & ~1;
+}
+
+static inline int trace_get(const struct dp *p, int i, int j) {
+  int d = i + j;
+  if (p->lanes)
+    return p->ltrace[((i - 1) * (2 * p->lw + 1) + j - i + p->lw) * p->lanes];
+  return (p->trace[p->doff[d] + ((i - trace_base(p, d)) >> 1)] >> (4 * (i & 1))) & 15;
+}
+
+static inline void trace_set(const struct dp *p, int i, int j, int tr) {
+  int d = i + j;
+  unsigned char *t = p->trace + p->doff[d] + ((i - trace_base(p, d)) >> 1);
+  *t = (*t & (0xf0 >> (4 * (i & 1)))) | (tr << (4 * (i & 1)));
+}
+
+// A problem waiting in the queue (see nw_queue); its strings are at off in
+// the workspace's qstr
+enum { Q_NW, Q_NW_BACKWARDS, Q_SW };
+
+struct queued {
+  int kind;
+  int len1, len2, w;
+  size_t off;
+  stack *s;
+  int *score, *indels, *ret;
+};
+
+struct _dp_workspace {
+  short *sbuf;         // The kernels' copies of the strings and score rows
+  size_t scap;
+  int *ibuf;           // doff, last and the scalar score rows
+  size_t icap;
+  unsigned char *trace;
+  size_t tcap;
+  stack *flips;
+  unsigned char *str[2];  // The strings as they are to be aligned (see dp_strings)
+  size_t strcap[2];
+  unsigned long long *bits; // Bit vectors for edit_distance_within
+  size_t bcap;
+  struct queued *q;
+  int nq, qcap;
+  unsigned char *qstr;
+  size_t qlen, qstrcap;
+  short *lbuf;         // Strings, score rows and trace for dp_lanes
+  size_t lcap;
+};
+
+// Makes sure that *buf has room for n elements of the given size
+static void *grow(void *buf, size_t *cap, size_t n, size_t size) {
+  if (n > *cap) {
+    *cap = 2 * n;
+    free(buf);
+    buf = malloc(*cap * size);
   }
-  for (i = 1; i <= len1; ++i) {
-    // Zero first column
-    pointers[i * (len2 + 1)] = 1;
-    values[i * (len2 + 1)] = -5-3*i;
-    for (j = 1; j <= len2; ++j) {
-      int skip1, skip2;
-      skip2 = (pointers[i * (len2 + 1) + j - 1] == 2) ? 0 : -5;
-      skip1 = (pointers[(i - 1) * (len2 + 1) + j] == 1) ? 0 : -5;
-      // Update cell appropriately
-      values[i * (len2 + 1) + j] =
-	max(values[(i-1) * (len2 + 1) + j - 1] + (((str1[i-1]==5)||(str1[i-1] == str2[j-1]))?0:-6),
-	    values[i * (len2 + 1) + j - 1] - 3 + skip2,
-	    values[(i-1) * (len2 + 1) + j] - 3 + skip1);
-      if (values[i * (len2 + 1) + j] == values[i * (len2 + 1) + j - 1] - 3 + skip2) {
-	pointers[i * (len2 + 1) + j] = 2; // skip on 2
-      }
-      else if (values[i * (len2 + 1) + j] == values[(i-1) * (len2 + 1) + j] - 3 + skip1) {
-	pointers[i * (len2 + 1) + j] = 1; // skip on 1
-      }
+  return buf;
+}
+
+dp_workspace *dp_workspace_make() {
+  dp_workspace *ws = calloc(1, sizeof(dp_workspace));
+  ws->flips = stack_make();
+  return ws;
+}
+
+void dp_workspace_destroy(dp_workspace *ws) {
+  free(ws->sbuf);
+  free(ws->ibuf);
+  free(ws->trace);
+  stack_destroy(ws->flips);
+  free(ws->str[0]);
+  free(ws->str[1]);
+  free(ws->bits);
+  free(ws->q);
+  free(ws->qstr);
+  free(ws->lbuf);
+  free(ws);
+}
+
+// Each byte of the packed genome as four bases, in order and backwards
+#define UNPACK(x) { (x) >> 6 & 3, (x) >> 4 & 3, (x) >> 2 & 3, (x) & 3 }
+#define UNPACK_REV(x) { (x) & 3, (x) >> 2 & 3, (x) >> 4 & 3, (x) >> 6 & 3 }
+#define X4(m, x) m(x), m(x + 1), m(x + 2), m(x + 3)
+#define X16(m, x) X4(m, x), X4(m, x + 4), X4(m, x + 8), X4(m, x + 12)
+#define X64(m, x) X16(m, x), X16(m, x + 16), X16(m, x + 32), X16(m, x + 48)
+static const unsigned char unpack_fwd[256][4] = {
+  X64(UNPACK, 0), X64(UNPACK, 64), X64(UNPACK, 128), X64(UNPACK, 192)
+};
+static const unsigned char unpack_rev[256][4] = {
+  X64(UNPACK_REV, 0), X64(UNPACK_REV, 64), X64(UNPACK_REV, 128), X64(UNPACK_REV, 192)
+};
+
+// Unpacks len bases of the packed genome (2 bits a base, first base in the
+// high bits) into dst, starting at pos, or if backwards is set going back
+// from pos - 1. Whole bytes go four bases at a time.
+static void unpack_ref(unsigned char *dst, const unsigned char *ref, long long pos, int len, int backwards) {
+  int i = 0;
+  if (!backwards) {
+    for (; i < len && ((pos + i) & 3); ++i)
+      dst[i] = ref_base(ref, pos + i);
+    for (; i + 4 <= len; i += 4)
+      memcpy(dst + i, unpack_fwd[ref[(pos + i) >> 2]], 4);
+    for (; i < len; ++i)
+      dst[i] = ref_base(ref, pos + i);
+  }
+  else {
+    for (; i < len && ((pos - i) & 3); ++i)
+      dst[i] = ref_base(ref, pos - 1 - i);
+    for (; i + 4 <= len; i += 4)
+      memcpy(dst + i, unpack_rev[ref[((pos - i) >> 2) - 1]], 4);
+    for (; i < len; ++i)
+      dst[i] = ref_base(ref, pos - 1 - i);
+  }
+}
+
+// The number of mismatches between str (N matching anything) and the len
+// bases of the genome from pos on, 32 bases at a time; anything over maxmis
+// comes back as maxmis + 1
+static int hamming_within(const unsigned char *str, int len, const unsigned char *ref, long long pos, int maxmis) {
+  int mis = 0;
+  for (int i = 0; i < len; i += 32) {
+    const int n = (len - i < 32) ? len - i : 32;
+    unsigned long long care, x = read_word(str + i, n, &care);
+    x = (x ^ seq_word(ref, pos + i, n)) & care;
+    mis += __builtin_popcountll((x | x >> 1) & 0x5555555555555555ULL);
+    if (mis > maxmis)
+      return maxmis + 1;
+  }
+  return mis;
+}
+
+int ungapped_fast(const unsigned char *str1, int len1, const unsigned char *ref, long long pos, stack *s, int *score, int xdrop) {
+  // Any gap costs more than one mismatch, so with at most one this is the
+  // best alignment there is; with X-drop even that one might be better
+  // clipped off, though
+  int maxmis = xdrop ? 0 : (GAP_OPEN + GAP_EXT - 1) / MISMATCH;
+  if (maxmis * MISMATCH > *score)
+    maxmis = *score / MISMATCH;
+  int mis = hamming_within(str1, len1, ref, pos, maxmis);
+  if (mis > maxmis)
+    return 0;
+  *score -= mis * MISMATCH;
+  stack_push(s, 'M', len1);
+  return 1;
+}
+
+// The GT-AG of nearly every intron, and the rarer GC-AG and AT-AC, as they
+// read on either strand of the genome (since the gene may be on the other
+// one)
+#define SEMICANONICAL 3
+#define NONCANONICAL 12
+static const char motifs[][5] = { "GTAG", "CTAC", "GCAG", "CTGC", "ATAC", "GTAT" };
+
+int splice_motif(const unsigned char *ref, long long start, long long end) {
+  const char m[4] = { "ACGT"[ref_base(ref, start)], "ACGT"[ref_base(ref, start + 1)],
+		      "ACGT"[ref_base(ref, end - 2)], "ACGT"[ref_base(ref, end - 1)] };
+  for (size_t i = 0; i < sizeof(motifs) / sizeof(motifs[0]); ++i)
+    if (!memcmp(m, motifs[i], 4))
+      return (i < 2) ? 0 : SEMICANONICAL;
+  return NONCANONICAL;
+}
+
+static inline int mismatch(unsigned char c, const unsigned char *ref, long long pos) {
+  return c <= 3 && c != ref_base(ref, pos);
+}
+
+// The mismatches (N matching anything) between the first word of a read
+// and 32 bases of the genome, both as from read_word and seq_word
+static inline int word_mismatches(unsigned long long w, unsigned long long care, unsigned long long g) {
+  unsigned long long x = (w ^ g) & care;
+  return __builtin_popcountll((x | x >> 1) & 0x5555555555555555ULL);
+}
+
+long long exon_search(const unsigned char *str, int len, const unsigned char *ref, long long lo, long long hi, int maxmis, int backwards) {
+  const int nw = (len + 31) / 32;
+  unsigned long long w[nw], care[nw];
+  for (int i = 0; i < nw; ++i)
+    w[i] = read_word(str + 32 * i, (len - 32 * i < 32) ? len - 32 * i : 32, &care[i]);
+  // The genome under the first word is slid along a base at a time (only
+  // its first n0 bases are kept, so none past the end are ever read), the
+  // rest only looked at if that's close enough
+  const int n0 = (len < 32) ? len : 32;
+  const unsigned long long keep = ~0ULL << (64 - 2 * n0);
+  unsigned long long g = seq_word(ref, backwards ? hi : lo, n0);
+  long long best = -1;
+  for (long long k = 0; k <= hi - lo; ++k) {
+    const long long pos = backwards ? hi - k : lo + k;
+    if (k) {
+      if (backwards)
+	g = (g >> 2 | (unsigned long long) ref_base(ref, pos) << 62) & keep;
       else
-	pointers[i * (len2 + 1) + j] = 0; // no skip
+	g = (g << 2 | (unsigned long long) ref_base(ref, pos + n0 - 1) << (64 - 2 * n0)) & keep;
+    }
+    int mis = word_mismatches(w[0], care[0], g);
+    for (int i = 1; i < nw && mis <= maxmis; ++i)
+      mis += word_mismatches(w[i], care[i], seq_word(ref, pos + 32 * i, (len - 32 * i < 32) ? len - 32 * i : 32));
+    if (mis <= maxmis) {
+      best = pos;
+      if (!mis)
+	break;
+      maxmis = mis - 1;
     }
   }
-  for (j = 0; j <= len2; ++j) {
-    if (values[len1 * (len2 + 1) + j] > mx) {
-      mx = values[len1 * (len2 + 1) + j];
-      maxloc = j;
+  return best;
+}
+
+int splice_fast(const unsigned char *str1, int len1, const unsigned char *ref, long long dpos, long long apos, stack *s, int *score) {
+  const long long intron = apos - len1 - dpos;
+  int don = 0, acc = 0, best = -1, bt = 0;
+  if (intron < 4)
+    return 0;
+  // Split at t, str1[..t) goes from dpos on and str1[t..) ends at apos;
+  // moving t along one moves one base from the acceptor side to the donor
+  for (int i = 0; i < len1; ++i)
+    acc += mismatch(str1[i], ref, apos - len1 + i);
+  for (int t = 0; t <= len1; ++t) {
+    if (t) {
+      don += mismatch(str1[t-1], ref, dpos + t - 1);
+      acc -= mismatch(str1[t-1], ref, apos - len1 + t - 1);
+    }
+    int cost = MISMATCH * (don + acc) + splice_motif(ref, dpos + t, dpos + t + intron);
+    if (best < 0 || cost < best) {
+      best = cost;
+      bt = t;
     }
   }
-  i = len1;
-  j = maxloc;
-  *score += values[i * (len2 + 1) + j];
-  // In theory something bad might have happened (some insertions on the end)
-  // if str1 wasn't long enough. I'm going to ignore that possibility :)
-  // But it's something to think about implementing
-  while (i && j) {
-    // Figure out which way the correct path goes; we can infer this directly
-    // from the score, in fact, but it's just easier to keep track of that
-    // from a separate pointer array ("pointer"; in this case it's just
-    // storing which way we're going)
-    
-    char dir = pointers[i * (len2 + 1) + j];
-    switch(dir) {
-    case 1:
-      i--;
-      stack_push(flips, 'I', 1);
-      (*indels)--;
-      break;
-    case 2:
-      j--;
-      stack_push(flips, 'D', 1);
-      (*indels)--;
-      break;
-    default: // 0
-      i--;
-      j--;
-      stack_push(flips, 'M', 1);
+  if (best > *score)
+    return 0;
+  *score -= best;
+  if (len1 > bt)
+    stack_push(s, 'M', len1 - bt);
+  stack_push(s, 'N', intron);
+  if (bt)
+    stack_push(s, 'M', bt);
+  return 1;
+}
+
+// Puts the strings the way round that the DP wants them (str1 and the
+// window of the genome both reversed, if backwards), into dst1 and dst2
+// (where dst1 may be str1 itself if it doesn't need turning round)
+static void put_strings(unsigned char *dst1, unsigned char *dst2, const unsigned char *str1, int len1, const unsigned char *ref, long long pos, int len2, int backwards) {
+  if (backwards)
+    for (int i = 0; i < len1; ++i)
+      dst1[i] = str1[len1-1-i];
+  unpack_ref(dst2, ref, pos, len2, backwards);
+}
+
+// The same into the workspace; str1 is updated to point at the right copy,
+// and the genome's is returned
+static const unsigned char *dp_strings(dp_workspace *ws, const unsigned char **str1, int len1, const unsigned char *ref, long long pos, int len2, int backwards) {
+  ws->str[0] = grow(ws->str[0], &ws->strcap[0], len1 + 1, 1);
+  ws->str[1] = grow(ws->str[1], &ws->strcap[1], len2 + 1, 1);
+  put_strings(ws->str[0], ws->str[1], *str1, len1, ref, pos, len2, backwards);
+  if (backwards)
+    *str1 = ws->str[0];
+  return ws->str[1];
+}
+
+// A batch of problems for the lanes kernels, one per lane; every array has
+// a (16-bit) element per lane for each entry
+struct lanes {
+  int w, n1;           // Widest band and longest str1 of them all
+  const short *a, *b;  // a[i] = str1[i-1] and b[j] = str2[j-1]
+  const short *lw, *floor, *ln1; // Each lane's w, floor and n1
+  short *rows;         // Five rows of 2 * w + 3 cells (with one either side)
+  short *trace;        // Row by row, 2 * w + 1 cells each
+  int *last;           // For each lane in turn, the band on its last row
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define KERNEL dp_sse41
+#define LANES_KERNEL dp_lanes_sse41
+#define KATTR __attribute__((target("sse4.1")))
+#define VEC __m128i
+#define VW 8
+#define VLOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define VSTORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define VSET1 _mm_set1_epi16
+#define VADD _mm_add_epi16
+#define VSUB _mm_sub_epi16
+#define VMAX _mm_max_epi16
+#define VCMPEQ _mm_cmpeq_epi16
+#define VCMPGT _mm_cmpgt_epi16
+#define VAND _mm_and_si128
+#define VOR _mm_or_si128
+#define VANDNOT _mm_andnot_si128
+#define VMOVEMASK _mm_movemask_epi8
+// Packs the trace in pairs of lanes (each 0-15) into a byte each
+#define VSTORE_TRACE(p, v) do {						\
+    __m128i _t = _mm_and_si128(_mm_or_si128(v, _mm_srli_epi32(v, 12)),	\
+			       _mm_set1_epi32(0xff));			\
+    int _x = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packus_epi32(_t, _t), _t)); \
+    memcpy(p, &_x, 4);							\
+  } while (0)
+#include "smw_kernel.h"
+#undef KERNEL
+#undef LANES_KERNEL
+#undef KATTR
+#undef VEC
+#undef VW
+#undef VLOAD
+#undef VSTORE
+#undef VSET1
+#undef VADD
+#undef VSUB
+#undef VMAX
+#undef VCMPEQ
+#undef VCMPGT
+#undef VAND
+#undef VOR
+#undef VANDNOT
+#undef VMOVEMASK
+#undef VSTORE_TRACE
+
+#define KERNEL dp_avx2
+#define LANES_KERNEL dp_lanes_avx2
+#define KATTR __attribute__((target("avx2")))
+#define VEC __m256i
+#define VW 16
+#define VLOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define VSTORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define VSET1 _mm256_set1_epi16
+#define VADD _mm256_add_epi16
+#define VSUB _mm256_sub_epi16
+#define VMAX _mm256_max_epi16
+#define VCMPEQ _mm256_cmpeq_epi16
+#define VCMPGT _mm256_cmpgt_epi16
+#define VAND _mm256_and_si256
+#define VOR _mm256_or_si256
+#define VANDNOT _mm256_andnot_si256
+#define VMOVEMASK _mm256_movemask_epi8
+#define VSTORE_TRACE(p, v) do {						\
+    __m256i _t = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v, 12)), \
+				  _mm256_set1_epi32(0xff));		\
+    _t = _mm256_packus_epi16(_mm256_packus_epi32(_t, _t), _t);		\
+    _t = _mm256_permutevar8x32_epi32(_t, _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0)); \
+    _mm_storel_epi64((__m128i *)(p), _mm256_castsi256_si128(_t));	\
+  } while (0)
+#include "smw_kernel.h"
+#endif
+
+// Widest vector we might use, in 16-bit lanes (for padding)
+#define VPAD 16
+
+// Reference (and fallback) implementation, for when the scores might not
+// fit into 16 bits; produces exactly the same trace as the kernels (though
+// it works by rows, so it may give up at a different point)
+static void dp_scalar(struct dp *p, const unsigned char *str1, const unsigned char *str2, int *h, int *f) {
+  const int n1 = p->n1, n2 = p->n2, w = p->w;
+  int i, j;
+  // Everything outside the band must look unreachable
+  for (j = 0; j <= n2 + 1; ++j) {
+    h[j] = (j <= w) ? (j ? -(GAP_OPEN + GAP_EXT * j) : 0) : NEG_INF * 1000;
+    f[j] = NEG_INF * 1000;
+  }
+  if (!n1)
+    for (j = 0; j <= n2 && j <= w; ++j)
+      p->last[j] = h[j];
+  for (i = 1; i <= n1; ++i) {
+    int jlo = (i - w > 1) ? i - w : 1, jhi = (i + w < n2) ? i + w : n2;
+    int diag = h[jlo-1], ev = NEG_INF * 1000, mx, mxc = NEG_INF * 1000;
+    if (jlo == 1)
+      h[0] = (i <= w) ? -(GAP_OPEN + GAP_EXT * i) : NEG_INF * 1000;
+    else
+      h[jlo-1] = NEG_INF * 1000;
+    mx = h[jlo-1];
+    for (j = jlo; j <= jhi; ++j) {
+      int dv = diag + (((str1[i-1] == 5) || (str1[i-1] == str2[j-1])) ? 0 : -MISMATCH);
+      int eo = h[j-1] - GAP_OPEN - GAP_EXT, ee = ev - GAP_EXT;
+      int fo = h[j] - GAP_OPEN - GAP_EXT, fe = f[j] - GAP_EXT;
+      unsigned char tr = ((ee > eo) ? TR_EEXT : 0) | ((fe > fo) ? TR_FEXT : 0);
+      ev = (ee > eo) ? ee : eo;
+      f[j] = (fe > fo) ? fe : fo;
+      diag = h[j];
+      h[j] = max(dv, ev, f[j]);
+      if (h[j] != dv)
+	tr |= (h[j] == ev) ? 2 : 1;
+      trace_set(p, i, j, tr);
+      if (h[j] > mx)
+	mx = h[j];
+      if (p->xdrop && h[j] + CLIP_PENALTY * i > mxc) {
+	mxc = h[j] + CLIP_PENALTY * i;
+	// Ties go to the earliest anti-diagonal, as in the kernels
+	if (mxc > p->best || (mxc == p->best && i + j < p->bi + p->bj)) {
+	  p->best = mxc;
+	  p->bi = i;
+	  p->bj = j;
+	}
+      }
+    }
+    // Every path crosses every row, so we can stop once a whole row is
+    // below the floor
+    if (mx < p->floor || (p->xdrop && mxc < p->best - p->xdrop))
       break;
+    if (i == n1)
+      for (j = (n1 - w > 0) ? n1 - w : 0; j <= jhi; ++j)
+	p->last[j] = h[j];
+  }
+}
+
+// Fills in the trace (and p->last, or p->best) for aligning str1 against
+// str2 globally; p->w, p->floor, p->free_end and p->xdrop should already
+// be set (see struct dp)
+static void dp_fill(struct dp *p, dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *str2, int len2) {
+  int d, i, w = p->w;
+  p->n1 = len1;
+  p->n2 = len2;
+  p->dmax = len1 + len2;
+  if (p->dmax > 2 * len1 + w)
+    p->dmax = 2 * len1 + w;
+  if (p->dmax > 2 * len2 + w)
+    p->dmax = 2 * len2 + w;
+  p->best = 0;
+  p->bi = p->bj = 0;
+  p->lanes = 0;
+  ws->ibuf = grow(ws->ibuf, &ws->icap, p->dmax + 2 + 3 * (len2 + 2), sizeof(int));
+  p->doff = ws->ibuf;
+  p->last = p->doff + p->dmax + 2;
+  p->doff[0] = 0;
+  for (d = 0; d <= p->dmax; ++d) {
+    int ilo = band_lo(p, d), ihi = band_hi(p, d);
+    if (ilo < 1)
+      ilo = 1;
+    if (ihi > d - 1)
+      ihi = d - 1;
+    p->doff[d+1] = p->doff[d] + ((ihi >= ilo) ? (ihi - trace_base(p, d)) / 2 + 1 : 0);
+  }
+  ws->trace = grow(ws->trace, &ws->tcap, p->doff[p->dmax + 1] + VPAD, 1);
+  p->trace = ws->trace;
+  for (i = 0; i <= len2; ++i)
+    p->last[i] = UNREACHED;
+#if defined(__x86_64__) || defined(__i386__)
+  // Scores in the band are bounded below by a path of mismatches and one
+  // gap; everything has to stay clear of NEG_INF
+  if (MISMATCH * ((len1 < len2) ? len1 : len2) + GAP_OPEN + GAP_EXT * w < -NEG_INF / 2 &&
+      CPU_SUPPORTS("sse4.1")) {
+    // The kernels may read one element before the start of each of these
+    // (see smw_kernel.h), and up to a vector past the end
+    const int row = len1 + 3 + VPAD;
+    ws->sbuf = grow(ws->sbuf, &ws->scap, 7 * row + len2 + 2 + VPAD, sizeof(short));
+    p->a = ws->sbuf + 1;
+    for (i = 0; i < 6; ++i) {
+      short *r = ws->sbuf + row * (i + 1) + 1;
+      if (i < 3)
+	p->h[i] = r;
+      else if (i < 5)
+	p->f[i-3] = r;
+      else
+	p->e = r;
     }
+    p->b = ws->sbuf + 7 * row + 1;
+    p->a[0] = 0;
+    for (i = 0; i < len1; ++i)
+      p->a[i+1] = str1[i];
+    for (i = 0; i < len2; ++i)
+      p->b[i] = str2[len2-1-i];
+    if (CPU_SUPPORTS("avx2"))
+      dp_avx2(p);
+    else
+      dp_sse41(p);
+    return;
   }
-  while (i) {
-    i--;
-    stack_push(flips, 'I', 1);
-    (*indels)--;
+#endif
+  dp_scalar(p, str1, str2, p->last + len2 + 1, p->last + 2 * len2 + 3);
+}
+
+// The band implied by the remaining budgets: no more than *indels gaps,
+// and no gap so long that it alone would use up *score
+static int band_width(int score, int indels) {
+  int w = (score - GAP_OPEN) / GAP_EXT;
+  if (score < GAP_OPEN)
+    w = 0;
+  return (w < indels) ? w : indels;
+}
+
+// The most edits (mismatches and gap bases) an alignment can have and still
+// fit in the budgets: gap bases cost at least GAP_EXT each, and there can
+// be no more than indels of them; everything else is a mismatch
+static int edit_budget(int score, int indels) {
+  if (score < GAP_EXT * indels)
+    return score / GAP_EXT;
+  return indels + (score - GAP_EXT * indels) / MISMATCH;
+}
+
+// Advances one 64-row block of Myers' bit vectors by a column; hin and the
+// return value are the horizontal deltas coming into the top of the block
+// and out of the row given by high
+static inline int advance_block(unsigned long long *pv, unsigned long long *mv,
+				unsigned long long eq, unsigned long long high, int hin) {
+  unsigned long long xv = eq | *mv, xh, ph, mh;
+  int hout = 0;
+  if (hin < 0)
+    eq |= 1;
+  xh = (((eq & *pv) + *pv) ^ *pv) | eq;
+  ph = *mv | ~(xh | *pv);
+  mh = *pv & xh;
+  if (ph & high)
+    hout = 1;
+  else if (mh & high)
+    hout = -1;
+  ph <<= 1;
+  mh <<= 1;
+  if (hin < 0)
+    mh |= 1;
+  else if (hin > 0)
+    ph |= 1;
+  *pv = mh | ~(xv | ph);
+  *mv = ph & xv;
+  return hout;
+}
+
+// Edit distance between all of str1 and any prefix of str2, by Myers'
+// bit-parallel algorithm, 64 rows of str1 to a word. Both of the alignments
+// that nw_fast and sw_fast look for start at the start of str2, so this is
+// a lower bound on the number of differences in them.
+// We go a block of rows at a time, keeping the horizontal deltas along the
+// bottom of the last block, and stop as soon as the answer is known to be
+// within maxd or not; the result is only exact when it is within maxd.
+// Reaching (i, j) takes |i - j| gaps, so a block only has to go maxd
+// columns past its last row, and everything beyond that is taken to go up
+// by one a column; that only makes paths that are over maxd anyway worse.
+int edit_distance_within(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *str2, int len2, int maxd) {
+  const int nb = (len1 + 63) / 64;
+  unsigned long long *peq;
+  signed char *hrow;
+  int i, j, b, jmax = 0;
+  // Every column brings the distance down by at most one
+  if (len1 - len2 > maxd)
+    return len1 - len2;
+  if (len1 <= maxd)
+    return len1;
+  ws->bits = grow(ws->bits, &ws->bcap, 4 * nb + len2 / 8 + 1, sizeof(unsigned long long));
+  peq = ws->bits;
+  hrow = (signed char *)(peq + 4 * nb);
+  memset(peq, 0, 4 * nb * sizeof(unsigned long long));
+  for (i = 0; i < len1; ++i) {
+    unsigned long long bit = 1ULL << (i & 63);
+    if (str1[i] > 3) // N matches anything
+      for (b = 0; b < 4; ++b)
+	peq[b * nb + i / 64] |= bit;
+    else
+      peq[str1[i] * nb + i / 64] |= bit;
   }
-  while (j) {
-    j--;
-    stack_push(flips, 'D', 1);
-    (*indels)--;
+  for (b = 0; b < nb; ++b) {
+    const int r = (b < nb - 1) ? 64 * b + 63 : len1 - 1;
+    const unsigned long long high = 1ULL << (r & 63);
+    unsigned long long pv = ~0ULL, mv = 0;
+    int d = r + 1, mn = d, prev = jmax;
+    jmax = (r + 1 + maxd < len2) ? r + 1 + maxd : len2;
+    for (j = 0; j < jmax; ++j) {
+      // The top row goes up by one every column
+      int h = (b && j < prev) ? hrow[j] : 1;
+      h = advance_block(&pv, &mv, peq[str2[j] * nb + b], high, h);
+      hrow[j] = h;
+      d += h;
+      if (d < mn)
+	mn = d;
+    }
+    // Every alignment crosses the last row of the block somewhere
+    if (mn > maxd || b == nb - 1)
+      return mn;
   }
-  stack_flip (flips, s);
-  free(pointers);
-  free(values);
-  return maxloc - 1;
+  return len1;
 }
 
-// The same thing, except this time we always backtrack from the end of both
-// strings (so obviously we don't need to return the position on str2 that
-// we aligned to), outputting to the stack
-// str1 still refers to the pattern and str2 to the genome, for consistency
-void sw_fast(const unsigned char *str1, int len1, const unsigned char *str2, int len2, stack *s, int *score, int *indels) {
-  int *values, i, j;
-  char *pointers;
-  values = malloc((len1 + 1) * (len2 + 1) * sizeof(int));
-  pointers = malloc((len1 + 1) * (len2 + 1));
-  // "Zero" first row
-  values[0] = 0;
-  for (j = 1; j <= len2; ++j) {
-    values[j] = -5-3*j;
-    pointers[j] = 2;
+int split_distance_within(dp_workspace *ws, const unsigned char *str1, int len1, int at, const unsigned char *ref, long long pos, int before, int after, int maxd) {
+  const unsigned char *s1 = str1 + at, *s2;
+  int d;
+  s2 = dp_strings(ws, &s1, len1 - at, ref, pos, after, 0);
+  d = edit_distance_within(ws, s1, len1 - at, s2, after, maxd);
+  if (d > maxd)
+    return d;
+  s1 = str1;
+  s2 = dp_strings(ws, &s1, at, ref, pos, before, 1);
+  return d + edit_distance_within(ws, s1, at, s2, before, maxd - d);
+}
+
+// The fewest differences between all of str1 and any substring of str2, if
+// no more than maxd (and something more otherwise), with the end of the
+// first (along str2) with that many in *end. The same as
+// edit_distance_within, except that an alignment can start anywhere along
+// str2, so the top row never goes up and every column has to be done.
+static int edit_search_within(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *str2, int len2, int maxd, int *end) {
+  const int nb = (len1 + 63) / 64;
+  unsigned long long *peq;
+  signed char *hrow;
+  int i, j, b, d = len1, mn = len1;
+  *end = 0;
+  if (len1 > maxd + len2 || len1 <= 0)
+    return len1;
+  ws->bits = grow(ws->bits, &ws->bcap, 4 * nb + len2 / 8 + 1, sizeof(unsigned long long));
+  peq = ws->bits;
+  hrow = (signed char *)(peq + 4 * nb);
+  memset(peq, 0, 4 * nb * sizeof(unsigned long long));
+  for (i = 0; i < len1; ++i) {
+    unsigned long long bit = 1ULL << (i & 63);
+    if (str1[i] > 3)
+      for (b = 0; b < 4; ++b)
+	peq[b * nb + i / 64] |= bit;
+    else
+      peq[str1[i] * nb + i / 64] |= bit;
   }
-  for (i = 1; i <= len1; ++i) {
-    // Zero first column
-    values[i * (len2 + 1)] = -5-3*i;
-    pointers[i * (len2 + 1)] = 1;
-    for (j = 1; j <= len2; ++j) {
-      int skip1, skip2;
-      skip2 = (pointers[i * (len2 + 1) + j - 1] == 2) ? 0 : -5;
-      skip1 = (pointers[(i - 1) * (len2 + 1) + j] == 1) ? 0 : -5;
-      // Update cell appropriately
-      values[i * (len2 + 1) + j] =
-	max(values[(i-1) * (len2 + 1) + j - 1] + (((str1[i-1]==5)||(str1[i-1] == str2[j-1]))?0:-6),
-	    values[i * (len2 + 1) + j - 1] - 3 + skip2,
-	    values[(i-1) * (len2 + 1) + j] - 3 + skip1);
-      if (values[i * (len2 + 1) + j] == values[i * (len2 + 1) + j - 1] - 3 + skip2)
-	pointers[i * (len2 + 1) + j] = 2; // skip on 2
-      else if (values[i * (len2 + 1) + j] == values[(i-1) * (len2 + 1) + j] - 3 + skip1)
-	pointers[i * (len2 + 1) + j] = 1; // skip on 1
-      else
-	pointers[i * (len2 + 1) + j] = 0; // no skip
+  for (b = 0; b < nb; ++b) {
+    const int r = (b < nb - 1) ? 64 * b + 63 : len1 - 1;
+    const unsigned long long high = 1ULL << (r & 63);
+    unsigned long long pv = ~0ULL, mv = 0;
+    for (j = 0; j < len2; ++j) {
+      int h = advance_block(&pv, &mv, peq[str2[j] * nb + b], high, b ? hrow[j] : 0);
+      hrow[j] = h;
+      if (b == nb - 1) {
+	d += h;
+	if (d < mn) {
+	  mn = d;
+	  *end = j + 1;
+	}
+      }
     }
   }
-  // Now we need to iterate back from the end of the match (len1, len2)
-  // and figure out the best (or A best) path. Because these segments are
-  // passed in forward order, we do not need to allocate another stack to
-  // do a flip (we are pushing them to the stack in back to front order, which
-  // is correct)
-  i = len1;
-  j = len2;
-  *score += values[i * (len2 + 1) + j];
+  return mn;
+}
+
+int search_fast(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *ref, long long pos, int len2, stack *s, int *score, int *indels, long long *start) {
+  const unsigned char *s1 = str1, *s2;
+  int end, clip, ret;
+  s2 = dp_strings(ws, &s1, len1, ref, pos, len2, 0);
+  if (edit_search_within(ws, s1, len1, s2, len2, edit_budget(*score, *indels), &end) > edit_budget(*score, *indels))
+    return 0;
+  // The end is known, so the rest is the same as aligning back from there
+  // (which puts up with the same differences, so finds the start)
+  const int size = s->size, back = (len1 + *indels < end) ? len1 + *indels : end;
+  ret = nw_fast(ws, str1, len1, ref, pos + end, back, 1, s, score, indels, 0, &clip);
+  if (*score < 0 || *indels < 0) {
+    s->size = size;
+    return 0;
+  }
+  *start = pos + end - 1 - ret;
+  return 1;
+}
+
+// Follows the trace back from (i, j) to the start, pushing the CIGAR (from
+// the end backwards) onto s
+static void traceback(const struct dp *p, int i, int j, stack *s, int *indels) {
+  int state = 0; // Which of H (0), F (1) or E (2) we're in
   while (i && j) {
-    // Figure out which way the correct path goes; we can infer this directly
-    // from the score, in fact, but it's just easier to keep track of that
-    // from a separate pointer array ("pointer"; in this case it's just
-    // storing which way we're going)
-    
-    // Since, as before, str1 refers to the pattern and str2 the genome,
-    // a skip on 1 is to be called a deletion (the base is present on the genome
-    // but not the read) and a skip on 2 an insertion. We do not output
-    // characters other than M, I, and D. Score can be calculated directly
-    // and trivially from the CIGAR if necessary.
-    char dir = pointers[i * (len2 + 1) + j];
-    switch(dir) {
+    int tr = trace_get(p, i, j);
+    if (!state)
+      state = tr & 3;
+    switch(state) {
     case 1:
+      // Since str1 refers to the pattern and str2 the genome, a skip on 1 is
+      // an insertion (the base is present on the read but not the genome)
+      // and a skip on 2 a deletion
       i--;
       stack_push(s, 'I', 1);
       (*indels)--;
+      state = (tr & TR_FEXT) ? 1 : 0;
       break;
     case 2:
       j--;
       stack_push(s, 'D', 1);
       (*indels)--;
+      state = (tr & TR_EEXT) ? 2 : 0;
       break;
     default: // 0
       i--;
@@ -199,14 +777,323 @@ void sw_fast(const unsigned char *str1, int len1, const unsigned char *str2, int
     stack_push(s, 'D', 1);
     (*indels)--;
   }
-  // verify contents of stack
-  //for (int k = 0; k < s->size; ++k) {
-  //  fprintf(stderr, "%c\n", s->chars[k]);
-  //}
+}
+
+// What nw_fast does before filling in the matrix: sets up p, and fails
+// (returning 0) if there is obviously nothing to be found
+static int nw_check(struct dp *p, dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *str2, int len2, int *score, int *indels, int xdrop) {
+  p->w = band_width(*score, *indels);
+  if (*score < 0 || *indels < 0 || (!xdrop && len1 - len2 > p->w)) {
+    *score = -1;
+    return 0;
+  }
+  // Don't bother with the DP if there are obviously too many differences
+  // (unless we can clip them off)
+  if (!xdrop) {
+    int maxd = edit_budget(*score, *indels);
+    if (edit_distance_within(ws, str1, len1, str2, len2, maxd) > maxd) {
+      *score = -1;
+      return 0;
+    }
+  }
+  p->floor = -*score;
+  p->free_end = 1;
+  p->xdrop = xdrop;
+  return 1;
+}
+
+// And what it does after
+static int nw_finish(const struct dp *p, dp_workspace *ws, int backwards, stack *s, int *score, int *indels, int *clip) {
+  int j, mx = UNREACHED, endi = p->n1, endj = 0;
+  if (p->xdrop) {
+    // The best place to stop, counting the clip
+    mx = p->best - CLIP_PENALTY * p->n1;
+    endi = p->bi;
+    endj = p->bj;
+  }
+  else {
+    // The end of str2 is free, so we take the best cell on the last row
+    for (j = 0; j <= p->n2; ++j) {
+      if (p->last[j] > mx) {
+	mx = p->last[j];
+	endj = j;
+      }
+    }
+  }
+  if (mx < -*score) {
+    *score = -1;
+    return 0;
+  }
+  *score += mx;
+  *clip = p->n1 - endi;
+  // The traceback comes out back to front, which is right for a tail but
+  // has to be flipped for a head
+  stack *out = backwards ? ws->flips : s;
+  if (*clip)
+    stack_push(out, 'S', *clip);
+  traceback(p, endi, endj, out, indels);
+  while (backwards && out->size) {
+    out->size--;
+    stack_push(s, out->chars[out->size], out->counts[out->size]);
+  }
+  return endj - 1;
+}
+
+// The same for sw_fast
+static int sw_check(struct dp *p, dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *str2, int len2, int *score, int *indels, int xdrop) {
+  p->w = band_width(*score, *indels);
+  int maxd = edit_budget(*score, *indels);
+  if (*score < 0 || *indels < 0 || abs(len1 - len2) > p->w ||
+      edit_distance_within(ws, str1, len1, str2, len2, maxd) > maxd) {
+    *score = -1;
+    return 0;
+  }
+  p->floor = -*score;
+  p->free_end = 0;
+  p->xdrop = xdrop;
+  return 1;
+}
+
+static void sw_finish(const struct dp *p, stack *s, int *score, int *indels) {
+  if (p->last[p->n2] < -*score) {
+    *score = -1;
+    return;
+  }
+  *score += p->last[p->n2];
+  // Because these segments are passed in forward order, we do not need to
+  // allocate another stack to do a flip (we are pushing them to the stack in
+  // back to front order, which is correct)
+  traceback(p, p->n1, p->n2, s, indels);
+}
+
+// Needleman-Wunsch with affine gaps, vectorised along anti-diagonals (see
+// smw_kernel.h) where the instruction set allows.
+
+// str1 should be the read (allowed characters are 0-3 and 5), in unpacked
+// form; str2 is the len2 bases of the packed genome ref from pos on, which
+// are unpacked straight into the workspace. 'N' on the read will be
+// treated as if it matches all characters.
+
+// Returns the position on str2 that the last character of str1 was aligned
+// to (-1 if none of str2 was used). Outputs some CIGARs to the given stack. This function can be used
+// to align both the head and tail; for the head, set backwards, and str1
+// and str2 are both read from their ends instead (str1 from str1[len1-1]
+// down, and str2 from the base before pos down), so that the first
+// characters compared are the ones the MMS failed on; the CIGAR still
+// comes out the right way round
+
+// Only alignments within the remaining *score and *indels are looked for;
+// if there are none *score is made negative and nothing is output
+
+// If xdrop is nonzero, the alignment is given up once its score drops more
+// than xdrop below the best seen so far, and the rest of str1 is clipped
+// (that many bases are put into *clip, and output as 'S')
+int nw_fast(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *ref, long long pos, int len2, int backwards, stack *s, int *score, int *indels, int xdrop, int *clip) {
+  //  fprintf(stderr, "%d %d\n", len1, len2);
+  *clip = 0;
+  if (len1 == 0) { // happens more often than you'd think
+    return -1; // Nothing at all to do
+  }
+  struct dp p;
+  const unsigned char *str2 = dp_strings(ws, &str1, len1, ref, pos, len2, backwards);
+  if (!nw_check(&p, ws, str1, len1, str2, len2, score, indels, xdrop))
+    return 0;
+  dp_fill(&p, ws, str1, len1, str2, len2);
+  return nw_finish(&p, ws, backwards, s, score, indels, clip);
+}
+
+// The same thing, except this time we always backtrack from the end of both
+// strings (so obviously we don't need to return the position on str2 that
+// we aligned to), outputting to the stack
+// str1 still refers to the pattern and str2 to the genome, for consistency
+// With xdrop set we simply fail, rather than clip, on dropping off
+void sw_fast(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *ref, long long pos, int len2, stack *s, int *score, int *indels, int xdrop) {
+  struct dp p;
+  const unsigned char *str2 = dp_strings(ws, &str1, len1, ref, pos, len2, 0);
+  if (!sw_check(&p, ws, str1, len1, str2, len2, score, indels, xdrop))
+    return;
+  dp_fill(&p, ws, str1, len1, str2, len2);
+  sw_finish(&p, s, score, indels);
+}
+
+// Queues a problem, putting the strings straight into the queue's own
+// space; returns 0 (having finished it) if it never needed to go in the
+// queue
+static int dp_queue(dp_workspace *ws, int kind, const unsigned char *str1, int len1, const unsigned char *ref, long long pos, int len2, stack *s, int *score, int *indels, int *ret) {
+  struct dp p;
+  struct queued *q;
+  unsigned char *str;
+  if (ws->qlen + len1 + len2 > ws->qstrcap) {
+    ws->qstrcap = 2 * (ws->qlen + len1 + len2);
+    ws->qstr = realloc(ws->qstr, ws->qstrcap);
+  }
+  str = ws->qstr + ws->qlen;
+  if (kind == Q_NW_BACKWARDS)
+    put_strings(str, str + len1, str1, len1, ref, pos, len2, 1);
+  else {
+    memcpy(str, str1, len1);
+    unpack_ref(str + len1, ref, pos, len2, 0);
+  }
+  if (kind == Q_SW ? !sw_check(&p, ws, str, len1, str + len1, len2, score, indels, 0)
+      : !nw_check(&p, ws, str, len1, str + len1, len2, score, indels, 0)) {
+    if (ret)
+      *ret = 0;
+    return 0;
+  }
+  if (ws->nq == ws->qcap) {
+    ws->qcap = ws->qcap ? 2 * ws->qcap : 64;
+    ws->q = realloc(ws->q, ws->qcap * sizeof(struct queued));
+  }
+  q = &ws->q[ws->nq++];
+  q->kind = kind;
+  q->len1 = len1;
+  q->len2 = len2;
+  q->w = p.w;
+  q->off = ws->qlen;
+  ws->qlen += len1 + len2;
+  q->s = s;
+  q->score = score;
+  q->indels = indels;
+  q->ret = ret;
+  return 1;
+}
+
+int nw_queue(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *ref, long long pos, int len2, int backwards, stack *s, int *score, int *indels, int *ret) {
+  if (len1 == 0) {
+    *ret = -1;
+    return 0;
+  }
+  return dp_queue(ws, backwards ? Q_NW_BACKWARDS : Q_NW, str1, len1, ref, pos, len2, s, score, indels, ret);
+}
+
+int sw_queue(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *ref, long long pos, int len2, stack *s, int *score, int *indels) {
+  return dp_queue(ws, Q_SW, str1, len1, ref, pos, len2, s, score, indels, 0);
+}
+
+// Finishes off a queued problem whose matrix is in p
+static void dequeue(struct dp *p, dp_workspace *ws, const struct queued *q) {
+  int clip;
+  if (q->kind == Q_SW)
+    sw_finish(p, q->s, q->score, q->indels);
+  else
+    *q->ret = nw_finish(p, ws, q->kind == Q_NW_BACKWARDS, q->s, q->score, q->indels, &clip);
+}
 
-  free(values);
-  free(pointers);
-  return;
+// Sorts the queue by length, so that lanes are mostly busy
+static int queued_cmp(const void *a, const void *b) {
+  return ((const struct queued *)a)->len1 - ((const struct queued *)b)->len1;
+}
+
+// Solves n queued problems (no more than lanes) side by side with the
+// lanes kernels, then finishes them off one by one
+static void dp_lanes(dp_workspace *ws, struct queued *q, int n, int lanes) {
+#if defined(__x86_64__) || defined(__i386__)
+  struct lanes g;
+  struct dp p;
+  int i, j, k, l, k1, n2 = 0;
+  short *a, *b, *lw, *floor, *ln1;
+  g.w = g.n1 = 0;
+  for (l = 0; l < n; ++l) {
+    if (q[l].w > g.w)
+      g.w = q[l].w;
+    if (q[l].len1 > g.n1)
+      g.n1 = q[l].len1;
+    if (q[l].len2 > n2)
+      n2 = q[l].len2;
+  }
+  k1 = 2 * g.w + 1;
+  ws->lbuf = grow(ws->lbuf, &ws->lcap, lanes * (2 * g.n1 + g.w + 5 + 5 * (k1 + 2) + g.n1 * k1), sizeof(short));
+  g.a = a = ws->lbuf;
+  g.b = b = a + (g.n1 + 1) * lanes;
+  g.lw = lw = b + (g.n1 + g.w + 1) * lanes;
+  g.floor = floor = lw + lanes;
+  g.ln1 = ln1 = floor + lanes;
+  g.rows = ln1 + lanes;
+  g.trace = g.rows + 5 * (k1 + 2) * lanes;
+  ws->ibuf = grow(ws->ibuf, &ws->icap, lanes * k1 + n2 + 1, sizeof(int));
+  g.last = ws->ibuf;
+  for (l = 0; l < lanes; ++l) {
+    // Spare lanes have nothing to do from the start
+    const struct queued *ql = (l < n) ? q + l : 0;
+    const unsigned char *str = ql ? ws->qstr + ql->off : 0;
+    const int len1 = ql ? ql->len1 : 0, len2 = ql ? ql->len2 : 0;
+    for (i = 1; i <= g.n1; ++i)
+      a[i * lanes + l] = (i <= len1) ? str[i-1] : 4;
+    for (j = 1; j <= g.n1 + g.w; ++j)
+      b[j * lanes + l] = (j <= len2) ? str[len1 + j - 1] : 4;
+    lw[l] = ql ? ql->w : 0;
+    // Nothing in a lane can get anywhere near as low as NEG_INF / 2
+    floor[l] = (ql && *ql->score < -NEG_INF / 2) ? -*ql->score : NEG_INF / 2;
+    ln1[l] = len1;
+    for (k = 0; k < k1; ++k)
+      g.last[l * k1 + k] = UNREACHED;
+  }
+  for (i = 0; i < 5 * (k1 + 2) * lanes; ++i)
+    g.rows[i] = NEG_INF;
+  // The first row, as in the kernels
+  for (k = g.w; k < k1; ++k)
+    for (l = 0; l < lanes; ++l)
+      g.rows[(k + 1) * lanes + l] = (k == g.w) ? 0 : (k - g.w <= lw[l]) ? -(GAP_OPEN + GAP_EXT * (k - g.w)) : NEG_INF;
+  if (lanes == 16)
+    dp_lanes_avx2(&g);
+  else
+    dp_lanes_sse41(&g);
+  p.lanes = lanes;
+  p.lw = g.w;
+  p.xdrop = 0;
+  p.last = g.last + lanes * k1;
+  for (l = 0; l < n; ++l) {
+    p.n1 = q[l].len1;
+    p.n2 = q[l].len2;
+    p.w = q[l].w;
+    p.ltrace = g.trace + l;
+    for (j = 0; j <= p.n2; ++j)
+      p.last[j] = UNREACHED;
+    for (k = g.w - p.w; k <= g.w + p.w; ++k) {
+      j = p.n1 + k - g.w;
+      if (j >= 0 && j <= p.n2)
+	p.last[j] = g.last[l * k1 + k];
+    }
+    dequeue(&p, ws, q + l);
+  }
+#endif
+}
+
+void dp_flush(dp_workspace *ws) {
+  int i, n = 0, lanes = 0;
+  struct dp p;
+#if defined(__x86_64__) || defined(__i386__)
+  if (CPU_SUPPORTS("avx2"))
+    lanes = 16;
+  else if (CPU_SUPPORTS("sse4.1"))
+    lanes = 8;
+#endif
+  // Scores in lanes have to stay clear of NEG_INF just as in dp_fill, and
+  // anything that might not goes through that instead (every row is
+  // filled in for every lane, so it is the length of str1 that matters);
+  // so does anything with no rows at all
+  for (i = 0; i < ws->nq; ++i) {
+    struct queued *q = ws->q + i;
+    if (lanes && q->len1 && MISMATCH * q->len1 + GAP_OPEN + GAP_EXT * q->w < -NEG_INF / 2) {
+      ws->q[n++] = *q;
+      continue;
+    }
+    const unsigned char *str = ws->qstr + q->off;
+    p.w = q->w;
+    p.floor = -*q->score;
+    p.free_end = (q->kind != Q_SW);
+    p.xdrop = 0;
+    dp_fill(&p, ws, str, q->len1, str + q->len1, q->len2);
+    dequeue(&p, ws, q);
+  }
+  // (ws->q is never allocated if nothing has been queued yet)
+  if (n) {
+    qsort(ws->q, n, sizeof(struct queued), queued_cmp);
+    for (i = 0; i < n; i += lanes)
+      dp_lanes(ws, ws->q + i, (n - i < lanes) ? n - i : lanes, lanes);
+  }
+  ws->nq = 0;
+  ws->qlen = 0;
 }
 
 // Note that this implementation takes the full O(m*n) memory; it is possible
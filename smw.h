@@ -3,10 +3,89 @@
 
 #include "stack.h"
 
+// Scoring (matches score 0): mismatch -6, and a gap of length k costs
+// -(GAP_OPEN + GAP_EXT * k) (i.e. proper affine gaps, per Gotoh)
+#define MISMATCH 6
+#define GAP_OPEN 5
+#define GAP_EXT 3
+
 int **smw(const char*, int, const char*, int);
 
-int nw_fast(const unsigned char *str1, int len1, const unsigned char *str2, int len2, stack *s, int *score, int *indels);
+// Everything the alignment functions need to work in, kept between calls
+// so that they never have to allocate anything once it has grown big
+// enough. One per thread.
+typedef struct _dp_workspace dp_workspace;
+
+dp_workspace *dp_workspace_make();
+
+void dp_workspace_destroy(dp_workspace *ws);
+
+// A lower bound for the number of differences (mismatches and gap bases)
+// between all of str1 and a prefix of str2, if it is more than
+// maxd; otherwise something no more than maxd. Uses the same alphabet as
+// nw_fast.
+int edit_distance_within(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *str2, int len2, int maxd);
+
+// The same for all of str1 against the packed genome ref, with str1[at]
+// lined up against ref[pos]: str1[at..] against (a prefix of) the after
+// bases from pos on, and str1[..at) against the before bases back from
+// pos - 1. An alignment with that point in it and no more than maxd
+// differences is then found if there is one.
+int split_distance_within(dp_workspace *ws, const unsigned char *str1, int len1, int at, const unsigned char *ref, long long pos, int before, int after, int maxd);
+
+// Finds where in the len2 bases of the genome from pos on all of str1 lines
+// up best (with no seed to go on, for when it's known roughly where it
+// should be): the best end is found by Myers' algorithm, and the alignment
+// is N-W back from there. If it fits in *score and *indels, pushes it,
+// takes it off them, puts where it starts in *start and returns 1;
+// otherwise returns 0.
+int search_fast(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *ref, long long pos, int len2, stack *s, int *score, int *indels, long long *start);
+
+// If str1 lines up with the len1 bases of the genome from pos on with so
+// few mismatches that no gapped (or, with xdrop set, clipped) alignment
+// could do better, and they fit in *score, pushes the whole thing as a
+// match, takes the mismatches off *score and returns 1; otherwise returns 0
+// and leaves everything alone. Much cheaper than any of the DP.
+int ungapped_fast(const unsigned char *str1, int len1, const unsigned char *ref, long long pos, stack *s, int *score, int xdrop);
+
+// What an intron from start to end (its first two bases from start on, its
+// last two back from end) costs by how unlike a splice site those look: 0
+// for GT-AG, up to two mismatches' worth (see smw.c) for neither end. For
+// a back-splice, end is before start; the same bases are looked at.
+int splice_motif(const unsigned char *ref, long long start, long long end);
+
+// Lines str1 up across an intron: some of it from dpos on and the rest
+// ending at apos, with the intron (at least 4 bases) in between and no
+// gaps. The split is put where the mismatches, plus how unlike a splice
+// site the ends of the intron look (GT-AG being the likeliest), cost least.
+// If that fits in *score, pushes it (with the intron as an N), takes it off
+// *score and returns 1; otherwise returns 0 and leaves everything alone.
+int splice_fast(const unsigned char *str1, int len1, const unsigned char *ref, long long dpos, long long apos, stack *s, int *score);
+
+// Where in the genome, from lo to hi, str (N matching anything) lines up
+// with the fewest mismatches, if no more than maxmis; the nearest of those
+// to lo (or to hi, if backwards) wins. -1 if there is nowhere. For finding
+// the other side of an intron when it is too short to have been seeded.
+long long exon_search(const unsigned char *str, int len, const unsigned char *ref, long long lo, long long hi, int maxmis, int backwards);
+
+// In these the genome side is len2 bases of the packed genome ref, from pos
+// on (or, for nw_fast with backwards set, going back from pos - 1), which
+// are read in place
+int nw_fast(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *ref, long long pos, int len2, int backwards, stack *s, int *score, int *indels, int xdrop, int *clip);
+
+void sw_fast(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *ref, long long pos, int len2, stack *s, int *score, int *indels, int xdrop);
+
+// Queued versions of nw_fast and sw_fast (without X-drop), for when there
+// are lots of independent problems about: queued problems are solved
+// together at the next dp_flush, up to 16 at once in SIMD lanes, and the
+// results then come out exactly as the unqueued versions would have given
+// them (nw_fast's return value going into *ret). The strings are unpacked
+// into the queue, but s, score, indels and ret have to stay put until then. Returns 0 if
+// the problem was settled without needing to be queued.
+int nw_queue(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *ref, long long pos, int len2, int backwards, stack *s, int *score, int *indels, int *ret);
+
+int sw_queue(dp_workspace *ws, const unsigned char *str1, int len1, const unsigned char *ref, long long pos, int len2, stack *s, int *score, int *indels);
 
-void sw_fast(const unsigned char *str1, int len1, const unsigned char *str2, int len2, stack *s, int *score, int *indels);
+void dp_flush(dp_workspace *ws);
 
 #endif /* _SMW_H */
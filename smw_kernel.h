@@ -0,0 +1,169 @@
+// Gotoh kernels. This is not a normal header: smw.c includes it once per
+// instruction set, with KERNEL and LANES_KERNEL (the function names), KATTR
+// (their target attribute), VEC, VW (lanes per vector) and the V*
+// operations defined for that instruction set.
+
+// Every cell on an anti-diagonal only depends on the previous two
+// anti-diagonals, so we can compute VW of them at once. Rows are indexed by
+// i (the position on str1), so the "up" neighbour is at i-1 on the last
+// anti-diagonal, the "left" one at i, and the diagonal one at i-1 two
+// anti-diagonals back. A band of width w only has about w+1 cells on each
+// anti-diagonal, so for the bands we use that is a single vector.
+
+// Each anti-diagonal is started from an even i so that the trace can be
+// stored two cells to a byte; when the band starts on an odd i, the first
+// lane computes rubbish for the cell before it, which is harmless since
+// that cell is reset below anyway (but it does mean reading one element
+// before the start of every row).
+static KATTR void KERNEL(struct dp *p) {
+  const int n1 = p->n1, n2 = p->n2;
+  short *h0 = p->h[0], *h1 = p->h[1], *h2 = p->h[2], *tmp;
+  short *f0 = p->f[0], *f1 = p->f[1], *e = p->e;
+  const VEC voe = VSET1(GAP_OPEN + GAP_EXT), vext = VSET1(GAP_EXT);
+  const VEC vmis = VSET1(-MISMATCH), vn = VSET1(5);
+  const VEC one = VSET1(1), two = VSET1(2), four = VSET1(4), eight = VSET1(8);
+  int prev = NEG_INF, prevc = NEG_INF, thresh = p->floor;
+  for (int d = 0; d <= p->dmax; ++d) {
+    int blo = band_lo(p, d), bhi = band_hi(p, d);
+    int ilo = (blo > 1) ? blo : 1, ihi = (bhi < d - 1) ? bhi : d - 1;
+    const int i0 = ilo & ~1;
+    unsigned char *t = p->trace + p->doff[d];
+    const short *b = p->b + n2 - d; // b[i] is str2[d-i-1]
+    for (int i = i0; i <= ihi; i += VW) {
+      VEC x = VLOAD(p->a + i), y = VLOAD(b + i);
+      VEC sc = VANDNOT(VOR(VCMPEQ(x, y), VCMPEQ(x, vn)), vmis);
+      VEC diag = VADD(VLOAD(h2 + i - 1), sc);
+      VEC eo = VSUB(VLOAD(h1 + i), voe), ee = VSUB(VLOAD(e + i), vext);
+      VEC fo = VSUB(VLOAD(h1 + i - 1), voe), fe = VSUB(VLOAD(f1 + i - 1), vext);
+      VEC ev = VMAX(eo, ee), fv = VMAX(fo, fe);
+      VEC hv = VMAX(diag, VMAX(ev, fv));
+      // Prefer a match/mismatch, then a skip on 2, then a skip on 1
+      VEC isdiag = VCMPEQ(hv, diag), ise = VCMPEQ(hv, ev);
+      VEC tr = VANDNOT(isdiag, VOR(VAND(ise, two), VANDNOT(ise, one)));
+      tr = VOR(tr, VOR(VAND(VCMPGT(ee, eo), four), VAND(VCMPGT(fe, fo), eight)));
+      VSTORE(h0 + i, hv);
+      VSTORE(e + i, ev);
+      VSTORE(f0 + i, fv);
+      VSTORE_TRACE(t + (i - i0) / 2, tr);
+    }
+    // The lanes past the end of the band wrote rubbish, and the next
+    // anti-diagonal reads the cells on either side of this one's band, so
+    // those are reset to unreachable before the boundary cells go in
+    h0[ilo-1] = e[ilo-1] = f0[ilo-1] = NEG_INF;
+    h0[ihi+1] = e[ihi+1] = f0[ihi+1] = NEG_INF;
+    if (d <= n2 && d <= p->w) {
+      h0[0] = d ? -(GAP_OPEN + GAP_EXT * d) : 0;
+      e[0] = h0[0];
+      f0[0] = NEG_INF;
+    }
+    if (d && d <= n1 && d <= p->w) {
+      h0[d] = -(GAP_OPEN + GAP_EXT * d);
+      e[d] = NEG_INF;
+      f0[d] = h0[d];
+    }
+    int mx = NEG_INF, mxc = NEG_INF;
+    for (int i = blo; i <= bhi; ++i) {
+      if (h0[i] > mx)
+	mx = h0[i];
+      if (p->xdrop && h0[i] + CLIP_PENALTY * i > mxc) {
+	mxc = h0[i] + CLIP_PENALTY * i;
+	if (mxc > p->best) {
+	  p->best = mxc;
+	  p->bi = i;
+	  p->bj = d - i;
+	}
+      }
+    }
+    if (d >= n1 && n1 >= blo && n1 <= bhi) {
+      p->last[d - n1] = h0[n1];
+      if (p->free_end && h0[n1] > thresh)
+	thresh = h0[n1];
+    }
+    // Scores never go up along a path, and every path crosses one of any
+    // two consecutive anti-diagonals; if neither has anything as good as
+    // the floor (or, if we can end anywhere, the best end we already have)
+    // we are done
+    if (((mx > prev) ? mx : prev) < thresh)
+      break;
+    if (p->xdrop && ((mxc > prevc) ? mxc : prevc) < p->best - p->xdrop)
+      break;
+    prev = mx;
+    prevc = mxc;
+    tmp = h2;
+    h2 = h1;
+    h1 = h0;
+    h0 = tmp;
+    tmp = f1;
+    f1 = f0;
+    f0 = tmp;
+  }
+}
+
+// The other way round: VW separate problems side by side, one per lane (see
+// dp_lanes), for when there are lots of small ones. The matrices are filled
+// in row by row, with each cell of the band (k = j - i + w, w being the
+// widest band of them all) a single vector operation. Each lane keeps
+// everything outside its own band unreachable, so it gets exactly the same
+// scores and trace as the kernel above (and traceback) would give it.
+// Lanes drop out once past their last row or once a whole row is below
+// their floor, and we stop once they all have.
+static KATTR void LANES_KERNEL(struct lanes *g) {
+  const int w = g->w, k1 = 2 * w + 1, row = (k1 + 2) * VW;
+  short *hp = g->rows + VW, *fp = hp + row, *hc = fp + row, *fc = hc + row;
+  short *e = fc + row, *tmp;
+  const VEC voe = VSET1(GAP_OPEN + GAP_EXT), vext = VSET1(GAP_EXT);
+  const VEC vmis = VSET1(-MISMATCH), vn = VSET1(5), neg = VSET1(NEG_INF);
+  const VEC one = VSET1(1), two = VSET1(2), four = VSET1(4), eight = VSET1(8);
+  const VEC lw = VLOAD(g->lw), floor = VLOAD(g->floor), n1 = VLOAD(g->ln1);
+  for (int i = 1; i <= g->n1; ++i) {
+    const VEC x = VLOAD(g->a + i * VW), vi = VSET1(i);
+    short *t = g->trace + (i - 1) * k1 * VW;
+    VEC mx = neg;
+    for (int k = 0; k < k1; ++k) {
+      const int j = i + k - w;
+      VEC hv, ev, fv;
+      if (j < 0) {
+	hv = ev = fv = neg;
+      }
+      else if (j == 0) {
+	VEC out = VCMPGT(vi, lw);
+	hv = fv = VOR(VAND(out, neg), VANDNOT(out, VSET1(-(GAP_OPEN + GAP_EXT * i))));
+	ev = neg;
+      }
+      else {
+	VEC y = VLOAD(g->b + j * VW);
+	VEC sc = VANDNOT(VOR(VCMPEQ(x, y), VCMPEQ(x, vn)), vmis);
+	VEC diag = VADD(VLOAD(hp + k * VW), sc);
+	VEC eo = VSUB(VLOAD(hc + (k - 1) * VW), voe), ee = VSUB(VLOAD(e + (k - 1) * VW), vext);
+	VEC fo = VSUB(VLOAD(hp + (k + 1) * VW), voe), fe = VSUB(VLOAD(fp + (k + 1) * VW), vext);
+	ev = VMAX(eo, ee);
+	fv = VMAX(fo, fe);
+	hv = VMAX(diag, VMAX(ev, fv));
+	VEC isdiag = VCMPEQ(hv, diag), ise = VCMPEQ(hv, ev);
+	VEC tr = VANDNOT(isdiag, VOR(VAND(ise, two), VANDNOT(ise, one)));
+	tr = VOR(tr, VOR(VAND(VCMPGT(ee, eo), four), VAND(VCMPGT(fe, fo), eight)));
+	VSTORE(t + k * VW, tr);
+	VEC out = VCMPGT(VSET1((k > w) ? k - w : w - k), lw);
+	hv = VOR(VAND(out, neg), VANDNOT(out, hv));
+	ev = VOR(VAND(out, neg), VANDNOT(out, ev));
+	fv = VOR(VAND(out, neg), VANDNOT(out, fv));
+      }
+      VSTORE(hc + k * VW, hv);
+      VSTORE(e + k * VW, ev);
+      VSTORE(fc + k * VW, fv);
+      mx = VMAX(mx, hv);
+    }
+    for (int l = 0; l < VW; ++l)
+      if (g->ln1[l] == i)
+	for (int k = 0; k < k1; ++k)
+	  g->last[l * k1 + k] = hc[k * VW + l];
+    if (!VMOVEMASK(VANDNOT(VCMPGT(floor, mx), VCMPGT(n1, vi))))
+      break;
+    tmp = hp;
+    hp = hc;
+    hc = tmp;
+    tmp = fp;
+    fp = fc;
+    fc = tmp;
+  }
+}
@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Regression tests for smw.c, which is included whole so that which
+// kernels it uses can be chosen here (see CPU_SUPPORTS), and its static
+// functions got at: unpacking the genome, exon_search against a
+// brute-force search, nw_fast and sw_fast against a plain full-matrix
+// Gotoh, and the queued DP against the unqueued, on every kernel the CPU
+// has
+
+// The kernels smw.c may use: 0 for the scalar code only, 1 for SSE4.1 as
+// well, 2 for AVX2 too (but never any the CPU hasn't got)
+static int level;
+
+static int cpu_supports(const char *isa) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (!strcmp(isa, "avx2"))
+    return level >= 2 && __builtin_cpu_supports("avx2");
+  return level >= 1 && __builtin_cpu_supports("sse4.1");
+#else
+  return 0;
+#endif
+}
+
+#define CPU_SUPPORTS(x) cpu_supports(x)
+#include "smw.c"
+
+#define GLEN 4096
+#define TRIES 40000
+
+// For the DP tests: how many problems go in the queue at once (at most),
+// the longest read, and how many batches there are of them
+#define BATCH 40
+#define MAXLEN 1500
+#define ROUNDS 400
+
+static const char *level_name[] = { "scalar", "SSE4.1", "AVX2" };
+
+static unsigned char getbase(const unsigned char *str, long long idx) {
+  return ((str[idx>>2])>>(2*(3-(idx&3)))) & 3;
+}
+
+// The nearest place to lo (or hi) with the fewest mismatches, if no more
+// than maxmis; -1 if there is none
+static long long brute(const unsigned char *str, int len, const unsigned char *ref, long long lo, long long hi, int maxmis, int backwards) {
+  long long best = -1;
+  int bestmis = maxmis + 1;
+  for (long long k = 0; k <= hi - lo; ++k) {
+    long long pos = backwards ? hi - k : lo + k;
+    int mis = 0;
+    for (int i = 0; i < len; ++i)
+      mis += str[i] <= 3 && str[i] != getbase(ref, pos + i);
+    if (mis < bestmis) {
+      best = pos;
+      bestmis = mis;
+    }
+  }
+  return best;
+}
+
+// Checks unpack_ref and seq_word against getbase, from every offset into a
+// byte and forwards and backwards; each gets a copy of the genome that
+// stops right after the last byte it should need, so that anything read
+// past that shows up under ASan
+static int unpack_test(const unsigned char *ref) {
+  unsigned char dst[100];
+  int fails = 0;
+  for (int t = 0; t < TRIES; ++t) {
+    const int len = rand() % 100, backwards = rand() & 1, n = 1 + rand() % 32;
+    const long long pos = 100 + rand() % (GLEN - 200);
+    long long bytes = (backwards ? pos - 1 : pos + len - 1) / 4 + 1;
+    unsigned char *cut = malloc(bytes);
+    memcpy(cut, ref, bytes);
+    unpack_ref(dst, cut, pos, len, backwards);
+    for (int i = 0; i < len; ++i)
+      if (dst[i] != getbase(ref, backwards ? pos - 1 - i : pos + i)) {
+	if (fails < 10)
+	  printf("unpack_ref at %lld len %d %s: base %d wrong\n", pos, len,
+		 backwards ? "backwards" : "forwards", i);
+	fails++;
+	break;
+      }
+    free(cut);
+    // seq_word only has to get the top 2n bits right
+    bytes = (pos + n - 1) / 4 + 1;
+    cut = malloc(bytes);
+    memcpy(cut, ref, bytes);
+    unsigned long long want = 0, got = seq_word(cut, pos, n);
+    for (int i = 0; i < n; ++i)
+      want |= (unsigned long long) getbase(ref, pos + i) << (62 - 2 * i);
+    if (n < 32)
+      got &= ~(~0ULL >> (2 * n));
+    if (got != want) {
+      if (fails < 10)
+	printf("seq_word at %lld n %d: got %016llx, expected %016llx\n", pos, n, got, want);
+      fails++;
+    }
+    free(cut);
+  }
+  printf("%d of %d unpacks wrong\n", fails, TRIES);
+  return fails;
+}
+
+// Checks exon_search over random windows of the genome, for reads both
+// shorter and longer than a word, forwards and backwards
+static int exon_test(const unsigned char *ref) {
+  unsigned char str[64];
+  int fails = 0;
+  for (int t = 0; t < TRIES; ++t) {
+    int len = 1 + rand() % 63, maxmis = rand() % 4, backwards = rand() & 1;
+    long long lo = rand() % (GLEN - 2 * 64), hi = lo + rand() % 64;
+    // Usually a copy of somewhere in the window, with a few changes
+    long long from = lo + rand() % (hi - lo + 1);
+    for (int i = 0; i < len; ++i) {
+      str[i] = getbase(ref, from + i);
+      if (rand() % 16 == 0)
+	str[i] = rand() % 4;
+      else if (rand() % 64 == 0)
+	str[i] = 5;
+    }
+    long long want = brute(str, len, ref, lo, hi, maxmis, backwards);
+    long long got = exon_search(str, len, ref, lo, hi, maxmis, backwards);
+    if (got != want) {
+      if (fails < 10)
+	printf("len %d lo %lld hi %lld maxmis %d %s: got %lld, expected %lld\n",
+	       len, lo, hi, maxmis, backwards ? "backwards" : "forwards", got, want);
+      fails++;
+    }
+  }
+  printf("%d of %d searches wrong\n", fails, TRIES);
+  return fails;
+}
+
+// One call of nw_fast (kind 0, or 1 for backwards) or sw_fast (kind 2)
+struct problem {
+  int kind, len1, len2, score, indels;
+  long long pos;
+  unsigned char str[MAXLEN];
+};
+
+// And what came out of it
+struct result {
+  int score, indels, ret;
+  stack *s;
+};
+
+// A read copied from somewhere in the genome, with mismatches, Ns and
+// gaps in it, and budgets that it may or may not fit in. Every so often it
+// is long enough (and has few enough changes to still fit) that 16-bit
+// scores might not do.
+static void make_problem(const unsigned char *ref, struct problem *p) {
+  const int maxlen = (rand() % 64) ? 120 : MAXLEN, rate = (maxlen == MAXLEN) ? 1024 : 160;
+  const long long src = 16 + rand() % (GLEN - 2 * MAXLEN);
+  int i = 0, c = 0;
+  p->kind = rand() % 3;
+  p->len1 = rand() % (maxlen + 1);
+  while (i < p->len1) {
+    int r = rand() % rate;
+    if (r == 0)
+      c += 1 + rand() % 4;
+    else if (r == 1)
+      for (int k = 1 + rand() % 4; k && i < p->len1; --k)
+	p->str[i++] = rand() % 4;
+    else {
+      p->str[i++] = (r < 4) ? rand() % 4 : (r == 4) ? 5 : ref_base(ref, src + c);
+      c++;
+    }
+  }
+  p->len2 = c + rand() % 9 - 4;
+  if (p->len2 < 0)
+    p->len2 = 0;
+  p->pos = (p->kind == 1) ? src + c : src;
+  p->score = rand() % (20 + p->len1 / 2);
+  p->indels = rand() % 6;
+}
+
+// Solves p directly, or queues it up (to be solved at the next dp_flush)
+static void solve(dp_workspace *ws, const unsigned char *ref, const struct problem *p, struct result *r, int queued) {
+  int clip;
+  r->score = p->score;
+  r->indels = p->indels;
+  r->ret = 0;
+  r->s->size = 0;
+  if (p->kind == 2) {
+    if (queued)
+      sw_queue(ws, p->str, p->len1, ref, p->pos, p->len2, r->s, &r->score, &r->indels);
+    else
+      sw_fast(ws, p->str, p->len1, ref, p->pos, p->len2, r->s, &r->score, &r->indels, 0);
+  }
+  else if (queued)
+    nw_queue(ws, p->str, p->len1, ref, p->pos, p->len2, p->kind, r->s, &r->score, &r->indels, &r->ret);
+  else
+    r->ret = nw_fast(ws, p->str, p->len1, ref, p->pos, p->len2, p->kind, r->s, &r->score, &r->indels, 0, &clip);
+}
+
+static void print_result(const char *what, const struct result *r) {
+  printf("  %s: score %d indels %d ret %d cigar ", what, r->score, r->indels, r->ret);
+  for (int i = r->s->size - 1; i >= 0; --i)
+    printf("%d%c", r->s->counts[i], r->s->chars[i]);
+  printf("\n");
+}
+
+// Whether got is the same as want (printing both if not)
+static int check(const struct problem *p, const struct result *want, const struct result *got, const char *how) {
+  int same = want->score == got->score && want->indels == got->indels &&
+    want->ret == got->ret && want->s->size == got->s->size;
+  for (int i = 0; same && i < want->s->size; ++i)
+    same = want->s->chars[i] == got->s->chars[i] && want->s->counts[i] == got->s->counts[i];
+  if (!same) {
+    printf("%s, %s: kind %d len1 %d len2 %d pos %lld score %d indels %d\n", how,
+	   level_name[level], p->kind, p->len1, p->len2, p->pos, p->score, p->indels);
+    print_result("expected", want);
+    print_result("got", got);
+  }
+  return same;
+}
+
+// The reference DP: like smw(), a full matrix, but with the aligner's own
+// scoring, and over only the cells with |i - j| <= w, as nw_fast and
+// sw_fast are. Puts the best score for all of str1 against each prefix of
+// str2 into last.
+static void gotoh(const unsigned char *str1, int len1, const unsigned char *str2, int len2, int w, int *last) {
+  const int n = (len1 + 1) * (len2 + 1), neg = INT_MIN / 4;
+  int *h = malloc(3 * n * sizeof(int)), *e = h + n, *f = e + n;
+  for (int i = 0; i <= len1; ++i) {
+    for (int j = 0; j <= len2; ++j) {
+      int *hc = h + i * (len2 + 1) + j, *ec = e + (hc - h), *fc = f + (hc - h);
+      *hc = *ec = *fc = neg;
+      if (abs(i - j) > w)
+	continue;
+      if (j)
+	*ec = (hc[-1] - GAP_OPEN > ec[-1]) ? hc[-1] - GAP_OPEN - GAP_EXT : ec[-1] - GAP_EXT;
+      if (i)
+	*fc = (hc[-len2-1] - GAP_OPEN > fc[-len2-1]) ? hc[-len2-1] - GAP_OPEN - GAP_EXT : fc[-len2-1] - GAP_EXT;
+      if (i && j)
+	*hc = hc[-len2-2] - ((str1[i-1] <= 3 && str1[i-1] != str2[j-1]) ? MISMATCH : 0);
+      else if (!i && !j)
+	*hc = 0;
+      *hc = max(*hc, *ec, *fc);
+    }
+  }
+  for (int j = 0; j <= len2; ++j)
+    last[j] = h[len1 * (len2 + 1) + j];
+  free(h);
+}
+
+// The fewest edits (mismatches and gap bases, N matching anything) between
+// all of str1 and all of str2, or if free_end is set a prefix of it
+static int edits(const unsigned char *str1, int len1, const unsigned char *str2, int len2, int free_end) {
+  int *row = malloc((len2 + 1) * sizeof(int)), best;
+  for (int j = 0; j <= len2; ++j)
+    row[j] = j;
+  for (int i = 1; i <= len1; ++i) {
+    int diag = row[0];
+    row[0] = i;
+    for (int j = 1; j <= len2; ++j) {
+      int d = diag + (str1[i-1] <= 3 && str1[i-1] != str2[j-1]);
+      diag = row[j];
+      row[j] = d;
+      if (row[j] > row[j-1] + 1)
+	row[j] = row[j-1] + 1;
+      if (row[j] > diag + 1)
+	row[j] = diag + 1;
+    }
+  }
+  best = row[len2];
+  for (int j = 0; free_end && j < len2; ++j)
+    if (row[j] < best)
+      best = row[j];
+  free(row);
+  return best;
+}
+
+// What the CIGAR on s (from the top down) costs with str1 against str2,
+// or -1 if it doesn't cover exactly len1 and len2 bases of them; the gap
+// bases in it go into *gaps
+static int rescore(const stack *s, const unsigned char *str1, int len1, const unsigned char *str2, int len2, int *gaps) {
+  int i = 0, j = 0, cost = 0;
+  *gaps = 0;
+  for (int k = s->size - 1; k >= 0; --k) {
+    const int c = s->counts[k];
+    if (s->chars[k] == 'M') {
+      for (int l = 0; l < c; ++l, ++i, ++j)
+	if (i < len1 && j < len2)
+	  cost += (str1[i] <= 3 && str1[i] != str2[j]) ? MISMATCH : 0;
+    }
+    else {
+      cost += GAP_OPEN + GAP_EXT * c;
+      *gaps += c;
+      if (s->chars[k] == 'I')
+	i += c;
+      else
+	j += c;
+    }
+  }
+  return (i == len1 && j == len2) ? cost : -1;
+}
+
+// Checks that nw_fast and sw_fast find the best alignment in the band if
+// it fits in the budget, both with the budgets as make_problem sets them
+// and with ones big enough for the band to take in everything. (They may
+// also give up if there are more edits to make than the budgets could
+// have room for, since the band doesn't stop gaps going back and forth.)
+// And that with X-drop the vector kernels agree (the scalar code works by
+// rows, so it may give up elsewhere).
+static int kernel_test(const unsigned char *ref) {
+  struct problem p;
+  struct result r, want;
+  unsigned char str1[MAXLEN], str2[2 * MAXLEN];
+  int last[2 * MAXLEN + 1];
+  dp_workspace *ws = dp_workspace_make();
+  int fails = 0, tries = 0;
+  r.s = stack_make();
+  want.s = stack_make();
+  want.ret = 0;
+  for (int t = 0; t < TRIES / 4; ++t) {
+    make_problem(ref, &p);
+    if (p.len1 > 200)
+      continue;
+    if (rand() & 1) {
+      p.indels = p.len1 + p.len2;
+      p.score = GAP_OPEN + GAP_EXT * p.indels;
+    }
+    // The strings the way round the DP sees them, and the best it can do
+    for (int i = 0; i < p.len1; ++i)
+      str1[i] = p.str[(p.kind == 1) ? p.len1 - 1 - i : i];
+    for (int j = 0; j < p.len2; ++j)
+      str2[j] = ref_base(ref, (p.kind == 1) ? p.pos - 1 - j : p.pos + j);
+    gotoh(str1, p.len1, str2, p.len2, band_width(p.score, p.indels), last);
+    int mx = last[p.len2], endj = p.len2, xdrop = 1 + rand() % 30;
+    if (p.kind != 2)
+      for (int j = p.len2; j >= 0; --j)
+	if (last[j] >= mx) {
+	  mx = last[j];
+	  endj = j;
+	}
+    for (level = 0; level <= 2; ++level) {
+      if (level && !cpu_supports(level == 2 ? "avx2" : "sse4.1"))
+	continue;
+      solve(ws, ref, &p, &r, 0);
+      tries++;
+      int ok, gaps;
+      if (mx < -p.score)
+	ok = r.score < 0 && !r.s->size;
+      else if (r.score < 0)
+	ok = !r.s->size && edits(str1, p.len1, str2, p.len2, p.kind != 2) > edit_budget(p.score, p.indels);
+      else {
+	if (p.kind == 1) // The CIGAR has been turned the right way round
+	  for (int k = 0; k < r.s->size / 2; ++k) {
+	    char c = r.s->chars[k];
+	    int n = r.s->counts[k];
+	    r.s->chars[k] = r.s->chars[r.s->size-1-k];
+	    r.s->counts[k] = r.s->counts[r.s->size-1-k];
+	    r.s->chars[r.s->size-1-k] = c;
+	    r.s->counts[r.s->size-1-k] = n;
+	  }
+	ok = r.score == p.score + mx && (p.kind == 2 || r.ret == endj - 1) &&
+	  rescore(r.s, str1, p.len1, str2, endj, &gaps) == -mx && r.indels == p.indels - gaps;
+      }
+      if (!ok) {
+	printf("%s: kind %d len1 %d len2 %d pos %lld score %d indels %d: expected score %d ret %d\n",
+	       level_name[level], p.kind, p.len1, p.len2, p.pos, p.score, p.indels,
+	       (mx < -p.score) ? -1 : p.score + mx, endj - 1);
+	print_result("got", &r);
+	fails++;
+      }
+      // And with X-drop, which has no reference of its own
+      if (level && p.kind != 2) {
+	int clip;
+	r.score = p.score;
+	r.indels = p.indels;
+	r.s->size = 0;
+	r.ret = nw_fast(ws, p.str, p.len1, ref, p.pos, p.len2, p.kind, r.s, &r.score, &r.indels, xdrop, &clip);
+	if (level == 1) {
+	  want.score = r.score;
+	  want.indels = r.indels;
+	  want.ret = r.ret;
+	  want.s->size = 0;
+	  for (int k = 0; k < r.s->size; ++k)
+	    stack_push(want.s, r.s->chars[k], r.s->counts[k]);
+	}
+	else {
+	  tries++;
+	  fails += !check(&p, &want, &r, "X-drop");
+	}
+      }
+    }
+  }
+  stack_destroy(r.s);
+  stack_destroy(want.s);
+  dp_workspace_destroy(ws);
+  printf("%d of %d alignments wrong\n", fails, tries);
+  return fails;
+}
+
+// Checks that batches of queued problems (of all sizes, so that some
+// batches fill several lots of lanes and some leave lanes spare) come out
+// exactly as they do unqueued, and that both come out the same on every
+// kernel as they do on the scalar code
+static int queue_test(const unsigned char *ref) {
+  static struct problem p[BATCH];
+  struct result want[BATCH], got[BATCH];
+  dp_workspace *ws = dp_workspace_make();
+  int fails = 0, tries = 0;
+  for (int i = 0; i < BATCH; ++i) {
+    want[i].s = stack_make();
+    got[i].s = stack_make();
+  }
+  for (level = 1; level <= 2; ++level)
+    if (!cpu_supports(level == 2 ? "avx2" : "sse4.1"))
+      printf("No %s here, so it went untested\n", level_name[level]);
+  for (int t = 0; t < ROUNDS; ++t) {
+    const int n = 1 + rand() % BATCH;
+    for (int i = 0; i < n; ++i)
+      make_problem(ref, p + i);
+    level = 0;
+    for (int i = 0; i < n; ++i)
+      solve(ws, ref, p + i, want + i, 0);
+    for (level = 0; level <= 2; ++level) {
+      if (level && !cpu_supports(level == 2 ? "avx2" : "sse4.1"))
+	continue;
+      for (int i = 0; i < n; ++i) {
+	solve(ws, ref, p + i, got + i, 0);
+	fails += !check(p + i, want + i, got + i, "unqueued");
+      }
+      for (int i = 0; i < n; ++i)
+	solve(ws, ref, p + i, got + i, 1);
+      dp_flush(ws);
+      for (int i = 0; i < n; ++i)
+	fails += !check(p + i, want + i, got + i, "queued");
+      tries += 2 * n;
+    }
+  }
+  for (int i = 0; i < BATCH; ++i) {
+    stack_destroy(want[i].s);
+    stack_destroy(got[i].s);
+  }
+  dp_workspace_destroy(ws);
+  printf("%d of %d alignments differed\n", fails, tries);
+  return fails;
+}
+
+int main(int argc, char **argv) {
+  unsigned char ref[GLEN / 4];
+  int fails = 0;
+  srand(argc > 1 ? atoi(argv[1]) : 1);
+  for (int i = 0; i < GLEN / 4; ++i)
+    ref[i] = rand() & 255;
+  fails += unpack_test(ref);
+  fails += exon_test(ref);
+  fails += kernel_test(ref);
+  fails += queue_test(ref);
+  return fails != 0;
+}
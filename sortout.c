@@ -0,0 +1,290 @@
+// Sorted output via sorted runs and an external merge. Two run buffers are
+// kept: callers fill one while a background thread sorts and spills the
+// other, so sorting happens while the aligner is still running.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "sortout.h"
+
+// How much merged output is collected before it is passed on
+#define MERGE_OUT (1 << 20)
+
+// A run is a single allocation of (at least) limit bytes, with the records
+// going in from the front and their entries from the back (the newest
+// first), so that everything it holds counts against the limit
+struct run_buf {
+  char *data;
+  size_t len, cap;
+  size_t n;
+};
+
+struct _sorter {
+  size_t limit;          // Bytes per run (records and their entries)
+  char *tmpdir;
+  struct run_buf bufs[2];
+  int cur;               // Buffer being filled
+  int pending;           // Buffer waiting to be spilled, or -1
+  int done;
+  FILE **runs;
+  int nruns, runcap;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+};
+
+// A run being merged: either a spilled file or the last in-memory run
+struct source {
+  FILE *f;
+  const struct run_buf *mem;
+  size_t next;
+  unsigned long long key;
+  char *rec;
+  size_t len, cap;
+};
+
+// The entries of a run, which end at the end of its allocation
+static inline sort_ent *run_ents(const struct run_buf *b) {
+  return (sort_ent *)(b->data + b->cap) - b->n;
+}
+
+// There is nothing sensible to do with what's been aligned without the
+// memory to sort it
+static void *sort_realloc(void *p, size_t n) {
+  p = realloc(p, n);
+  if (!p) {
+    fprintf(stderr, "Out of memory sorting output\n");
+    exit(-1);
+  }
+  return p;
+}
+
+// Ties go by where the records are in the run (the order they came in),
+// since the entries are in there the other way round
+static int ent_cmp(const void *a, const void *b) {
+  unsigned long long x = ((const sort_ent *)a)->key, y = ((const sort_ent *)b)->key;
+  if (x == y)
+    return (((const sort_ent *)a)->off > ((const sort_ent *)b)->off) -
+      (((const sort_ent *)a)->off < ((const sort_ent *)b)->off);
+  return (x > y) - (x < y);
+}
+
+// Writes out a sorted buffer as a run of (key, length, record) triples.
+// The file is unlinked straight away so it goes away however we exit.
+static void spill(sorter *s, struct run_buf *b) {
+  const sort_ent *ents = run_ents(b);
+  char *name = sort_realloc(0, strlen(s->tmpdir) + 32);
+  sprintf(name, "%s/single_align.XXXXXX", s->tmpdir);
+  int fd = mkstemp(name);
+  if (fd < 0) {
+    perror("Could not create temporary file");
+    exit(-1);
+  }
+  unlink(name);
+  free(name);
+  FILE *f = fdopen(fd, "w+b");
+  setvbuf(f, 0, _IOFBF, 1 << 20);
+  for (size_t i = 0; i < b->n; ++i) {
+    unsigned long long len = ents[i].len;
+    fwrite(&ents[i].key, sizeof(ents[i].key), 1, f);
+    fwrite(&len, sizeof(len), 1, f);
+    fwrite(b->data + ents[i].off, 1, len, f);
+  }
+  if (fflush(f)) {
+    perror("Could not write temporary file");
+    exit(-1);
+  }
+  rewind(f);
+  pthread_mutex_lock(&s->lock);
+  if (s->nruns == s->runcap) {
+    s->runcap = s->runcap ? 2 * s->runcap : 16;
+    s->runs = sort_realloc(s->runs, s->runcap * sizeof(FILE *));
+  }
+  s->runs[s->nruns++] = f;
+  pthread_mutex_unlock(&s->lock);
+  b->len = 0;
+  b->n = 0;
+}
+
+static void *sort_worker(void *arg) {
+  sorter *s = arg;
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    while (s->pending < 0 && !s->done)
+      pthread_cond_wait(&s->cond, &s->lock);
+    if (s->pending < 0)
+      break;
+    struct run_buf *b = &s->bufs[s->pending];
+    pthread_mutex_unlock(&s->lock);
+    qsort(run_ents(b), b->n, sizeof(sort_ent), ent_cmp);
+    spill(s, b);
+    pthread_mutex_lock(&s->lock);
+    s->pending = -1;
+    pthread_cond_broadcast(&s->cond);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+sorter *sorter_make(size_t membytes, const char *tmpdir) {
+  sorter *s = calloc(1, sizeof(sorter));
+  if (!s)
+    return 0;
+  s->limit = membytes / 2;
+  s->tmpdir = strdup(tmpdir);
+  s->pending = -1;
+  pthread_mutex_init(&s->lock, 0);
+  pthread_cond_init(&s->cond, 0);
+  pthread_create(&s->thread, NULL, sort_worker, s);
+  return s;
+}
+
+void sorter_add(sorter *s, const char *data, const sort_ent *ents, size_t n) {
+  if (!n)
+    return;
+  size_t len = ents[n-1].off + ents[n-1].len - ents[0].off;
+  const size_t need = len + n * sizeof(sort_ent);
+  struct run_buf *b;
+  pthread_mutex_lock(&s->lock);
+  // If these won't fit in the run, hand it over once the last one has been
+  // spilled. Another thread may have been waiting to do the same, and got
+  // there first, so whether they (still) don't fit is looked at again each
+  // time round.
+  for (;;) {
+    b = &s->bufs[s->cur];
+    if (!b->n || b->len + b->n * sizeof(sort_ent) + need <= s->limit)
+      break;
+    if (s->pending >= 0) {
+      pthread_cond_wait(&s->cond, &s->lock);
+      continue;
+    }
+    s->pending = s->cur;
+    s->cur ^= 1;
+    pthread_cond_broadcast(&s->cond);
+  }
+  // A run is only ever made bigger than the limit when it is empty, for
+  // something that wouldn't otherwise fit at all (keeping the entries
+  // aligned at the end)
+  if (b->cap < need) {
+    b->cap = ((need > s->limit ? need : s->limit) + 7) & ~(size_t)7;
+    free(b->data);
+    b->data = sort_realloc(0, b->cap);
+  }
+  memcpy(b->data + b->len, data + ents[0].off, len);
+  for (size_t i = 0; i < n; ++i) {
+    b->n++;
+    *run_ents(b) = ents[i];
+    run_ents(b)->off += b->len - ents[0].off;
+  }
+  b->len += len;
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Loads the next record of a run; returns 0 when there are no more
+static int source_next(struct source *src) {
+  if (src->mem) {
+    if (src->next == src->mem->n)
+      return 0;
+    const sort_ent *e = &run_ents(src->mem)[src->next++];
+    src->key = e->key;
+    src->rec = src->mem->data + e->off;
+    src->len = e->len;
+    return 1;
+  }
+  unsigned long long len;
+  if (fread(&src->key, sizeof(src->key), 1, src->f) != 1 ||
+      fread(&len, sizeof(len), 1, src->f) != 1)
+    return 0;
+  if (len > src->cap) {
+    src->cap = 2 * len;
+    src->rec = sort_realloc(src->rec, src->cap);
+  }
+  src->len = len;
+  if (fread(src->rec, 1, len, src->f) != len) {
+    fprintf(stderr, "Temporary file truncated\n");
+    exit(-1);
+  }
+  return 1;
+}
+
+// Restores the heap property below heap[i]
+static void sift_down(struct source **heap, int n, int i) {
+  for (;;) {
+    int l = 2 * i + 1, m = i;
+    if (l < n && heap[l]->key < heap[m]->key)
+      m = l;
+    if (l + 1 < n && heap[l+1]->key < heap[m]->key)
+      m = l + 1;
+    if (m == i)
+      return;
+    struct source *t = heap[i];
+    heap[i] = heap[m];
+    heap[m] = t;
+    i = m;
+  }
+}
+
+void sorter_finish(sorter *s, void (*out)(void *, const char *, size_t), void *arg) {
+  pthread_mutex_lock(&s->lock);
+  while (s->pending >= 0)
+    pthread_cond_wait(&s->cond, &s->lock);
+  s->done = 1;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+  pthread_join(s->thread, NULL);
+
+  // The last run never needs to go to disk
+  struct run_buf *last = &s->bufs[s->cur];
+  if (last->n)
+    qsort(run_ents(last), last->n, sizeof(sort_ent), ent_cmp);
+  int nsrc = s->nruns + 1, n = 0;
+  struct source *srcs = sort_realloc(0, nsrc * sizeof(struct source));
+  struct source **heap = sort_realloc(0, nsrc * sizeof(struct source *));
+  memset(srcs, 0, nsrc * sizeof(struct source));
+  for (int i = 0; i < s->nruns; ++i)
+    srcs[i].f = s->runs[i];
+  srcs[s->nruns].mem = last;
+  for (int i = 0; i < nsrc; ++i)
+    if (source_next(&srcs[i]))
+      heap[n++] = &srcs[i];
+  for (int i = n / 2 - 1; i >= 0; --i)
+    sift_down(heap, n, i);
+
+  char *buf = sort_realloc(0, 2 * MERGE_OUT);
+  size_t len = 0, cap = 2 * MERGE_OUT;
+  while (n) {
+    struct source *src = heap[0];
+    if (len + src->len > cap) {
+      cap = 2 * (len + src->len);
+      buf = sort_realloc(buf, cap);
+    }
+    memcpy(buf + len, src->rec, src->len);
+    len += src->len;
+    if (len >= MERGE_OUT) {
+      out(arg, buf, len);
+      len = 0;
+    }
+    if (!source_next(src))
+      heap[0] = heap[--n];
+    sift_down(heap, n, 0);
+  }
+  if (len)
+    out(arg, buf, len);
+  free(buf);
+
+  for (int i = 0; i < s->nruns; ++i) {
+    fclose(s->runs[i]);
+    free(srcs[i].rec);
+  }
+  free(srcs);
+  free(heap);
+  free(s->runs);
+  for (int i = 0; i < 2; ++i)
+    free(s->bufs[i].data);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->cond);
+  free(s->tmpdir);
+  free(s);
+}
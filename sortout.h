@@ -0,0 +1,32 @@
+#ifndef _SORTOUT_H
+#define _SORTOUT_H
+
+#include <stddef.h>
+
+// External sort of output records by key. Records are accumulated into a
+// memory-bounded run; once that is full it is handed to a background
+// thread to be sorted and spilled to a temporary file while the next run
+// fills up. At the end the runs are k-way merged.
+
+// A record within a buffer
+typedef struct _sort_ent {
+  unsigned long long key;
+  size_t off;
+  size_t len;
+} sort_ent;
+
+typedef struct _sorter sorter;
+
+// membytes bounds the memory used for runs (two of them are held at
+// once); temporary files go in tmpdir
+sorter *sorter_make(size_t membytes, const char *tmpdir);
+
+// Adds n records, whose bytes are in data. May be called from several
+// threads.
+void sorter_add(sorter *s, const char *data, const sort_ent *ents, size_t n);
+
+// Merges everything, passing the records out in order (in large pieces)
+// through out, then frees the sorter
+void sorter_finish(sorter *s, void (*out)(void *, const char *, size_t), void *arg);
+
+#endif /* _SORTOUT_H */